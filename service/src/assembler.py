@@ -141,6 +141,8 @@ _OPCODE_LIST = [
     Opcode(32, 1, 'ULK'),
     Opcode(33, 2, 'LSK'),
     Opcode(34, 1, 'RND'),
+    Opcode(35, 2, 'RDW'),
+    Opcode(36, 2, 'WRW'),
 ]
     
 
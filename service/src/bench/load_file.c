@@ -0,0 +1,81 @@
+// Times load_file and the cached loads LOD does on each program given,
+// e.g. ./load_file ../os ../sh ../hsh
+// The first program is the OS, the others are loaded on top of it (and
+// of each other) like LOD does. The timed loads don't keep their
+// instructions, but their exports pile up like they do in a long shell
+// session.
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../instruction_store.h"
+
+#define LOADS 200
+
+extern instruction* instructions;
+extern uint32_t num_instructions;
+
+static double now()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static loaded_code_info load(int fd, bool is_privileged, bool cached)
+{
+   off_t file_size = lseek(fd, 0, SEEK_END);
+   lseek(fd, 0, SEEK_SET);
+   if (cached)
+   {
+	  return load_cached_file(fd, is_privileged);
+   }
+   return load_file(fd, file_size, is_privileged);
+}
+
+// Average seconds per load
+static double time_loads(char* filename, int fd, bool is_privileged, bool cached)
+{
+   uint32_t base_instructions = num_instructions;
+   double start = now();
+   for (int i = 0; i < LOADS; i++)
+   {
+	  if (load(fd, is_privileged, cached).error == -1)
+	  {
+		 fprintf(stderr, "%s: load failed\n", filename);
+		 exit(-1);
+	  }
+	  num_instructions = base_instructions;
+   }
+   return (now() - start) / LOADS;
+}
+
+int main(int argc, char** argv)
+{
+   if (argc < 2)
+   {
+	  fprintf(stderr, "Usage: %s os [program...]\n", argv[0]);
+	  exit(-1);
+   }
+
+   for (int i = 1; i < argc; i++)
+   {
+	  int fd = open(argv[i], O_RDONLY);
+	  if (fd == -1)
+	  {
+		 perror(argv[i]);
+		 exit(-1);
+	  }
+
+	  double uncached = time_loads(argv[i], fd, i == 1, false);
+	  double cached = time_loads(argv[i], fd, i == 1, true);
+	  // Keep one for the programs after this one to link against
+	  loaded_code_info result = load(fd, i == 1, false);
+	  close(fd);
+
+	  printf("%-12s %6u instructions %9.1f us per load %9.1f us cached\n", argv[i], result.current_num_instructions, uncached * 1e6, cached * 1e6);
+   }
+   return 0;
+}
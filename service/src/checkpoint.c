@@ -0,0 +1,298 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "instruction_store.h"
+
+#define CHECKPOINT_SAVE_MS 1000
+
+checkpoint_control* checkpoint = NULL;
+
+static void (*save_unit_state)(int fd) = NULL;
+
+bool checkpoint_init(char* snapshot_path)
+{
+   checkpoint = (checkpoint_control*) mmap(NULL, sizeof(checkpoint_control), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (checkpoint == MAP_FAILED)
+   {
+	  #ifdef DEBUG
+	  perror("mmap fail");
+	  #endif
+	  checkpoint = NULL;
+	  return false;
+   }
+
+   checkpoint->fd = open(snapshot_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (checkpoint->fd == -1)
+   {
+	  #ifdef DEBUG
+	  perror("Error creating the snapshot");
+	  #endif
+	  return false;
+   }
+   atomic_init(&checkpoint->busy, 0);
+   atomic_init(&checkpoint->work, 0);
+   atomic_init(&checkpoint->requests, 0);
+   atomic_init(&checkpoint->saved, 0);
+   atomic_init(&checkpoint->num_pending_packets, 0);
+   atomic_init(&checkpoint->output_length, 0);
+   return true;
+}
+
+bool checkpoint_hold_packet(execution_packet packet)
+{
+   uint32_t index = atomic_fetch_add(&checkpoint->num_pending_packets, 1);
+   if (index >= MAX_PENDING_PACKETS)
+   {
+	  atomic_fetch_sub(&checkpoint->num_pending_packets, 1);
+	  return false;
+   }
+   checkpoint->pending_packets[index] = packet;
+   return true;
+}
+
+void checkpoint_wrote_output(char* data, size_t length)
+{
+   if (checkpoint == NULL)
+   {
+	  return;
+   }
+   uint64_t start = atomic_fetch_add(&checkpoint->output_length, length);
+   for (size_t i = 0; i < length; i++)
+   {
+	  checkpoint->output[(start + i) % MAX_SNAPSHOT_OUTPUT] = data[i];
+   }
+}
+
+bool checkpoint_write_output(int fd)
+{
+   uint64_t length = atomic_load(&checkpoint->output_length);
+   if (length <= MAX_SNAPSHOT_OUTPUT)
+   {
+	  return checkpoint_write_section(fd, SNAPSHOT_OUTPUT, 1, length) &&
+		 checkpoint_write(fd, checkpoint->output, length);
+   }
+   // Oldest byte first
+   uint64_t oldest = length % MAX_SNAPSHOT_OUTPUT;
+   return checkpoint_write_section(fd, SNAPSHOT_OUTPUT, 1, MAX_SNAPSHOT_OUTPUT) &&
+	  checkpoint_write(fd, checkpoint->output + oldest, MAX_SNAPSHOT_OUTPUT - oldest) &&
+	  checkpoint_write(fd, checkpoint->output, oldest);
+}
+
+volatile sig_atomic_t checkpoint_save_requested = 0;
+
+// The last request this unit saved for
+static uint32_t last_request = 0;
+
+static void save_requested(int signal)
+{
+   checkpoint_save_requested = 1;
+}
+
+void checkpoint_on_request(queue* input, void (*save_state)(int fd))
+{
+   save_unit_state = save_state;
+   // No SA_RESTART, so a unit sleeping on its input wakes up
+   struct sigaction action = {.sa_handler = save_requested, .sa_flags = 0};
+   sigemptyset(&action.sa_mask);
+   sigaction(SIGUSR1, &action, NULL);
+   queue_set_interrupt(input, &checkpoint_save_requested);
+}
+
+void checkpoint_save()
+{
+   checkpoint_save_requested = 0;
+   // The signal is sent until the unit has saved, so it can come more
+   // than once per request
+   uint32_t request = atomic_load(&checkpoint->requests);
+   if (request != last_request)
+   {
+	  last_request = request;
+	  save_unit_state(checkpoint->fd);
+	  atomic_fetch_add(&checkpoint->saved, 1);
+   }
+}
+
+bool checkpoint_request(pid_t unit)
+{
+   uint32_t saved = atomic_load(&checkpoint->saved);
+   atomic_fetch_add(&checkpoint->requests, 1);
+   for (int i = 0; i < CHECKPOINT_SAVE_MS; i++)
+   {
+	  // Again each time, the unit misses it if it comes just before
+	  // the unit goes to sleep on its input
+	  kill(unit, SIGUSR1);
+	  usleep(1000);
+	  if (atomic_load(&checkpoint->saved) != saved)
+	  {
+		 return true;
+	  }
+   }
+   return false;
+}
+
+bool checkpoint_write(int fd, void* data, size_t size)
+{
+   char* next = (char*)data;
+   while (size > 0)
+   {
+	  ssize_t result = write(fd, next, size);
+	  if (result <= 0)
+	  {
+		 return false;
+	  }
+	  next += result;
+	  size -= result;
+   }
+   return true;
+}
+
+bool checkpoint_write_section(int fd, snapshot_section_type type, uint32_t element_size, uint64_t count)
+{
+   snapshot_section section = {.type = type, .element_size = element_size, .count = count};
+   return checkpoint_write(fd, &section, sizeof(snapshot_section));
+}
+
+bool checkpoint_write_header(int fd, uint32_t seed)
+{
+   snapshot_header header = {.version = SNAPSHOT_VERSION, .seed = seed};
+   memcpy(header.magic_bytes, SNAPSHOT_MAGIC, sizeof(header.magic_bytes));
+   return checkpoint_write(fd, &header, sizeof(snapshot_header));
+}
+
+// Read a section's elements into a new array
+static void* read_section(FILE* file, snapshot_section* section)
+{
+   void* elements = malloc(section->element_size * section->count + 1);
+   if (fread(elements, section->element_size, section->count, file) != section->count)
+   {
+	  free(elements);
+	  return NULL;
+   }
+   return elements;
+}
+
+// Sections of the same type (one per matching unit) are appended
+static bool append_section(FILE* file, snapshot_section* section, void** elements, unsigned long* count)
+{
+   void* more = read_section(file, section);
+   if (more == NULL)
+   {
+	  return false;
+   }
+   *elements = realloc(*elements, section->element_size * (*count + section->count) + 1);
+   memcpy((char*)*elements + section->element_size * *count, more, section->element_size * section->count);
+   *count += section->count;
+   free(more);
+   return true;
+}
+
+machine_snapshot* load_snapshot(char* snapshot_path)
+{
+   FILE* file = fopen(snapshot_path, "r");
+   if (file == NULL)
+   {
+	  #ifdef DEBUG
+	  perror("Error opening the snapshot");
+	  #endif
+	  return NULL;
+   }
+
+   machine_snapshot* to_return = (machine_snapshot*)calloc(1, sizeof(machine_snapshot));
+   instruction* instructions = NULL;
+   unsigned long num_instructions = 0;
+   snapshot_export* exports = NULL;
+   unsigned long num_exports = 0;
+
+   snapshot_header header;
+   if (fread(&header, sizeof(snapshot_header), 1, file) != 1 ||
+	   memcmp(header.magic_bytes, SNAPSHOT_MAGIC, sizeof(header.magic_bytes)) != 0 ||
+	   header.version != SNAPSHOT_VERSION)
+   {
+	  goto fail;
+   }
+   to_return->seed = header.seed;
+
+   snapshot_section section;
+   while (fread(&section, sizeof(snapshot_section), 1, file) == 1)
+   {
+	  bool ok;
+	  switch (section.type)
+	  {
+		 case SNAPSHOT_INSTRUCTIONS:
+			ok = section.element_size == sizeof(instruction) &&
+			   append_section(file, &section, (void**)&instructions, &num_instructions);
+			break;
+
+		 case SNAPSHOT_EXPORTS:
+			ok = section.element_size == sizeof(snapshot_export) &&
+			   append_section(file, &section, (void**)&exports, &num_exports);
+			break;
+
+		 case SNAPSHOT_WAITING_TOKENS:
+			ok = section.element_size == sizeof(token_type) &&
+			   append_section(file, &section, (void**)&to_return->waiting_tokens, &to_return->num_waiting_tokens);
+			break;
+
+		 case SNAPSHOT_TRAPPED_TOKENS:
+			ok = section.element_size == sizeof(trapped_token) &&
+			   append_section(file, &section, (void**)&to_return->trapped_tokens, &to_return->num_trapped_tokens);
+			break;
+
+		 case SNAPSHOT_PENDING_PACKETS:
+			ok = section.element_size == sizeof(execution_packet) &&
+			   append_section(file, &section, (void**)&to_return->pending_packets, &to_return->num_pending_packets);
+			break;
+
+		 case SNAPSHOT_OUTPUT:
+			ok = section.element_size == 1 &&
+			   append_section(file, &section, (void**)&to_return->output, &to_return->output_length);
+			break;
+
+		 case SNAPSHOT_MODULE_CALLS:
+			ok = section.element_size == sizeof(module_call) &&
+			   append_section(file, &section, (void**)&to_return->module_calls, &to_return->num_module_calls);
+			break;
+
+		 default:
+			ok = false;
+			break;
+	  }
+	  if (!ok)
+	  {
+		 #ifdef DEBUG
+		 fprintf(stderr, "Bad snapshot section type=%u element_size=%u count=%lu\n", section.type, section.element_size, section.count);
+		 #endif
+		 goto fail;
+	  }
+   }
+
+   if (instructions == NULL)
+   {
+	  goto fail;
+   }
+   restore_instruction_store(instructions, num_instructions, exports, num_exports);
+   free(exports);
+   fclose(file);
+   return to_return;
+
+  fail:
+   #ifdef DEBUG
+   fprintf(stderr, "%s is not a usable snapshot\n", snapshot_path);
+   #endif
+   free(instructions);
+   free(exports);
+   free(to_return->waiting_tokens);
+   free(to_return->trapped_tokens);
+   free(to_return->pending_packets);
+   free(to_return->output);
+   free(to_return->module_calls);
+   free(to_return);
+   fclose(file);
+   return NULL;
+}
@@ -0,0 +1,160 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "queue.h"
+#include "sephi.h"
+#include "types.h"
+
+/*
+  Snapshot file: a snapshot_header followed by sections, each a
+  snapshot_section followed by count elements of element_size bytes.
+  A snapshot is taken once the machine is quiescent (nothing in any
+  queue and no unit working), so the only in-flight work is the I/O
+  packets that were waiting for stdin. What the machine wrote to stdout
+  so far is kept too, a restored machine prints it again first.
+*/
+#define SNAPSHOT_MAGIC "manchSNP"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+   uint8_t magic_bytes[8];
+   uint32_t version;
+   // The processing units reseed random() with this on restore, so
+   // new tag areas don't follow the ones handed out before the snapshot
+   uint32_t seed;
+} snapshot_header;
+
+typedef enum {
+   SNAPSHOT_INSTRUCTIONS,
+   SNAPSHOT_EXPORTS,
+   SNAPSHOT_WAITING_TOKENS,
+   SNAPSHOT_TRAPPED_TOKENS,
+   SNAPSHOT_PENDING_PACKETS,
+   SNAPSHOT_OUTPUT,
+   SNAPSHOT_MODULE_CALLS,
+} snapshot_section_type;
+
+typedef struct {
+   uint32_t type;
+   uint32_t element_size;
+   uint64_t count;
+} snapshot_section;
+
+typedef struct {
+   destination_type destination;
+   char name[REFERENCE_MAX_SIZE];
+} snapshot_export;
+
+typedef struct {
+   destination_type key;
+   token_type token;
+} trapped_token;
+
+// A loaded program's main that hasn't returned yet. It runs in its own
+// tag area and returns to the LOD at address, in return_tag.
+typedef struct {
+   tag_area_type area;
+   uint32_t address;
+   tag_type return_tag;
+} module_call;
+
+// What a restored machine starts from instead of the boot
+typedef struct {
+   uint32_t seed;
+   token_type* waiting_tokens;
+   unsigned long num_waiting_tokens;
+   trapped_token* trapped_tokens;
+   unsigned long num_trapped_tokens;
+   execution_packet* pending_packets;
+   unsigned long num_pending_packets;
+   char* output;
+   unsigned long output_length;
+   module_call* module_calls;
+   unsigned long num_module_calls;
+} machine_snapshot;
+
+#define MAX_PENDING_PACKETS 64
+// Only the end of a longer output is kept
+#define MAX_SNAPSHOT_OUTPUT (64 * 1024)
+
+// Shared between the units while a snapshot is being taken
+typedef struct {
+   int fd;
+   // Work the units have taken and not finished yet, and how often
+   // they took any. Quiescent is busy == 0 with work standing still.
+   _Atomic int64_t busy;
+   _Atomic uint64_t work;
+   // Saves asked for so far, and units that wrote their part of the
+   // snapshot
+   _Atomic uint32_t requests;
+   _Atomic uint32_t saved;
+   // stdin reads the input module held back instead of blocking
+   _Atomic uint32_t num_pending_packets;
+   execution_packet pending_packets[MAX_PENDING_PACKETS];
+   // Everything written to stdout, output[i % MAX_SNAPSHOT_OUTPUT]
+   _Atomic uint64_t output_length;
+   char output[MAX_SNAPSHOT_OUTPUT];
+} checkpoint_control;
+
+// NULL unless this machine is being checkpointed
+extern checkpoint_control* checkpoint;
+
+/* Must be called before the units are forked */
+bool checkpoint_init(char* snapshot_path);
+
+static inline void checkpoint_took_work(unsigned long amount)
+{
+   if (checkpoint != NULL && amount != 0)
+   {
+	  atomic_fetch_add(&checkpoint->busy, amount);
+	  atomic_fetch_add(&checkpoint->work, 1);
+   }
+}
+
+static inline void checkpoint_finished_work(unsigned long amount)
+{
+   if (checkpoint != NULL && amount != 0)
+   {
+	  atomic_fetch_sub(&checkpoint->busy, amount);
+   }
+}
+
+/* Hold back packet until the restore, true if it was */
+bool checkpoint_hold_packet(execution_packet packet);
+
+/* Keep what was written to stdout for the snapshot */
+void checkpoint_wrote_output(char* data, size_t length);
+bool checkpoint_write_output(int fd);
+
+/* save_state writes the unit's sections when the machine asks for them
+   (SIGUSR1). The handler only sets checkpoint_save_requested and stops
+   the wait on input, the unit saves from its main loop with
+   checkpoint_save_if_requested. */
+void checkpoint_on_request(queue* input, void (*save_state)(int fd));
+/* Ask unit to write its sections and wait until it has */
+bool checkpoint_request(pid_t unit);
+
+extern volatile sig_atomic_t checkpoint_save_requested;
+void checkpoint_save();
+
+static inline void checkpoint_save_if_requested()
+{
+   if (checkpoint_save_requested)
+   {
+	  checkpoint_save();
+   }
+}
+
+bool checkpoint_write(int fd, void* data, size_t size);
+bool checkpoint_write_section(int fd, snapshot_section_type type, uint32_t element_size, uint64_t count);
+bool checkpoint_write_header(int fd, uint32_t seed);
+
+/* Loads the instructions and exports into the instruction store, returns the rest or NULL */
+machine_snapshot* load_snapshot(char* snapshot_path);
+
+#endif /* CHECKPOINT_H */
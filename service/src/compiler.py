@@ -70,6 +70,8 @@ SPECIAL_FUNCTIONS = [Function("OUTD", "", ["output"], True, False),
                      Function("UNLINK", "", ["path"], True, True),
                      Function("LSEEK", "", ["fd", "offset"], True, True),
                      Function("RANDOM", "", ["input"], True, True),
+                     Function("READWORD", "", ["fd", "num"], True, True),
+                     Function("WRITEWORD", "", ["fd_and_count", "word"], True, True),
 ]
 
 GENERATE_ASSEMBLY_SPECIAL_FUNCTIONS = {'OUTD': lambda args: f"OUTD {args[0]}\n",
@@ -84,7 +86,9 @@ GENERATE_ASSEMBLY_SPECIAL_FUNCTIONS = {'OUTD': lambda args: f"OUTD {args[0]}\n",
                                        'SENDFILE': lambda args: f"{args[-1]} = SDF {args[0]} {args[1]}\n",
                                        'UNLINK': lambda args: f"{args[-1]} = ULK {args[0]}\n",
                                        'LSEEK': lambda args: f"{args[-1]} = LSK {args[0]} {args[1]}\n",
-                                       'RANDOM': lambda args: f"{args[-1]} = RND {args[0]}\n"
+                                       'RANDOM': lambda args: f"{args[-1]} = RND {args[0]}\n",
+                                       'READWORD': lambda args: f"{args[-1]} = RDW {args[0]} {args[1]}\n",
+                                       'WRITEWORD': lambda args: f"{args[-1]} = WRW {args[0]} {args[1]}\n",
 }
 
 class ExtractFunctionsPass(lark.visitors.Interpreter):
@@ -1,182 +1,1148 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include "checkpoint.h"
 #include "input_module.h"
 
-void run_input_module(queue* preprocessed_executable_packet_queue, queue* processed_executable_packet_queue)
+bool is_input_module_opcode(opcode_type opcode)
 {
-   while(1)
+   switch(opcode)
+   {
+      case OPN:
+      case RED:
+      case WRT:
+      case CLS:
+      case LS:
+      case SDF:
+      case ULK:
+      case LSK:
+      case RDW:
+      case WRW:
+         return true;
+
+      default:
+         return false;
+   }
+}
+
+// RED is one byte at a time, so reads are served from a per-fd
+// read-ahead buffer. The kernel's offset is ahead of the program's by
+// whatever is still buffered. The lock isn't held across read(), a
+// thread in read() sets reading instead.
+typedef struct {
+   pthread_mutex_t lock;
+   pthread_cond_t read_done;
+   bool reading;
+   char* data;
+   size_t start;
+   size_t end;
+} read_buffer;
+
+static read_buffer read_buffers[MAX_BUFFERED_FDS];
+
+static void init_read_buffers()
+{
+   for (int i = 0; i < MAX_BUFFERED_FDS; i++)
+   {
+      pthread_mutex_init(&read_buffers[i].lock, NULL);
+      pthread_cond_init(&read_buffers[i].read_done, NULL);
+      read_buffers[i].reading = false;
+      read_buffers[i].data = NULL;
+      read_buffers[i].start = 0;
+      read_buffers[i].end = 0;
+   }
+}
+
+// Must hold buffer->lock, which is dropped while read() blocks
+static ssize_t read_unlocked(int fd, read_buffer* buffer, char* data, size_t size)
+{
+   buffer->reading = true;
+   pthread_mutex_unlock(&buffer->lock);
+   ssize_t result = read(fd, data, size);
+   pthread_mutex_lock(&buffer->lock);
+   buffer->reading = false;
+   pthread_cond_broadcast(&buffer->read_done);
+   return result;
+}
+
+// Must hold buffer->lock. Whatever another thread is reading from fd
+// comes before what we read.
+static void wait_for_reads(read_buffer* buffer)
+{
+   while (buffer->reading)
    {
-      execution_packet next;
-      queue_remove(preprocessed_executable_packet_queue, &next, sizeof(execution_packet));
+      pthread_cond_wait(&buffer->read_done, &buffer->lock);
+   }
+}
+
+// Same results as read(fd, input, 1)
+static int buffered_read(int fd, char* input)
+{
+   if (fd < 0 || fd >= MAX_BUFFERED_FDS)
+   {
+      return read(fd, input, 1);
+   }
 
-      switch(next.opcode)
+   int result = 1;
+   read_buffer* buffer = &read_buffers[fd];
+   pthread_mutex_lock(&buffer->lock);
+   wait_for_reads(buffer);
+   if (buffer->start == buffer->end)
+   {
+      if (buffer->data == NULL)
+      {
+         buffer->data = (char*)malloc(READ_AHEAD_SIZE);
+      }
+      ssize_t num_read = read_unlocked(fd, buffer, buffer->data, READ_AHEAD_SIZE);
+      if (num_read <= 0)
       {
-         case OPN: {
-            char filename[9];
-            int machine_flags = (int)next.data_2;
-            strncpy(filename, (char*)&next.data_1, 8);
-            filename[8] = '\0';
+         result = num_read;
+         goto done;
+      }
+      buffer->start = 0;
+      buffer->end = num_read;
+   }
+   *input = buffer->data[buffer->start];
+   buffer->start += 1;
 
-            int os_flags = 0;
+  done:
+   pthread_mutex_unlock(&buffer->lock);
+   return result;
+}
 
-            if (FLAG_TO_RW_MODE(machine_flags) == FILE_READ_ONLY)
-            {
-               os_flags |= O_RDONLY;
-            }
-            else if (FLAG_TO_RW_MODE(machine_flags) == FILE_WRITE_ONLY)
-            {
-               os_flags |= O_WRONLY;
-            }
-            else if (FLAG_TO_RW_MODE(machine_flags) == FILE_READ_WRITE)
-            {
-               os_flags |= O_RDWR;
-            }
+// Forget what is buffered for fd. With rewind the kernel's offset is
+// first moved back to where the program thinks it is, which fails
+// (and the buffer is kept) for pipes and sockets, where reads and
+// writes don't share an offset anyway.
+static void drop_read_buffer(int fd, bool rewind)
+{
+   if (fd < 0 || fd >= MAX_BUFFERED_FDS)
+   {
+      return;
+   }
 
-            if ((machine_flags & FILE_CREATE) != 0)
-            {
-               os_flags |= O_CREAT;
-            }
-            if ((machine_flags & FILE_TRUNCATE) != 0)
-            {
-               os_flags |= O_TRUNC;
-            }
+   read_buffer* buffer = &read_buffers[fd];
+   pthread_mutex_lock(&buffer->lock);
+   off_t buffered = buffer->end - buffer->start;
+   if (!rewind || buffered == 0 || lseek(fd, -buffered, SEEK_CUR) != -1)
+   {
+      buffer->start = 0;
+      buffer->end = 0;
+   }
+   pthread_mutex_unlock(&buffer->lock);
+}
+
+// WRT to a regular file is coalesced in a per-fd write-behind buffer.
+// stdin/stdout/stderr and anything that isn't a regular file (ttys,
+// pipes, sockets) is written straight through, so output that someone
+// is waiting on is never held back.
+typedef struct {
+   pthread_mutex_t lock;
+   char* data;
+   size_t count;
+   // whether fd has been looked at since it was opened, and if so
+   // whether it gets buffered, and which file it is
+   bool checked;
+   bool buffered;
+   dev_t device;
+   ino_t inode;
+} write_buffer;
+
+static write_buffer write_buffers[MAX_BUFFERED_FDS];
+// How many of them hold data, so reads only look for writes to their
+// file when there are any
+static _Atomic int num_unflushed_buffers = 0;
 
-            int new_fd = open(filename, os_flags, 0600);
-            #ifdef DEBUG
-            fprintf(stderr, "Input_module: Opening file %s with os_flags %p new_fd=%d\n", filename, os_flags, new_fd);
-            #endif
+static void init_write_buffers()
+{
+   for (int i = 0; i < MAX_BUFFERED_FDS; i++)
+   {
+      pthread_mutex_init(&write_buffers[i].lock, NULL);
+      write_buffers[i].data = NULL;
+      write_buffers[i].count = 0;
+      write_buffers[i].checked = false;
+      write_buffers[i].buffered = false;
+   }
+}
+
+// Must hold buffer->lock. False if the data could not all be written,
+// it is dropped either way.
+static bool flush_write_buffer_locked(int fd, write_buffer* buffer)
+{
+   if (buffer->count == 0)
+   {
+      return true;
+   }
+   atomic_fetch_sub(&num_unflushed_buffers, 1);
+   size_t written = 0;
+   while (written < buffer->count)
+   {
+      ssize_t result = write(fd, buffer->data + written, buffer->count - written);
+      if (result <= 0)
+      {
+         #ifdef DEBUG
+         perror("Input_module: write behind failed");
+         #endif
+         buffer->count = 0;
+         return false;
+      }
+      written += result;
+   }
+   buffer->count = 0;
+   return true;
+}
+
+static void flush_write_buffer(int fd)
+{
+   if (fd < 0 || fd >= MAX_BUFFERED_FDS)
+   {
+      return;
+   }
+
+   write_buffer* buffer = &write_buffers[fd];
+   pthread_mutex_lock(&buffer->lock);
+   flush_write_buffer_locked(fd, buffer);
+   pthread_mutex_unlock(&buffer->lock);
+}
+
+// Before reading fd: flush writes to the same file through any fd,
+// they may be buffered under another one
+static void flush_writes_to_file(int fd)
+{
+   struct stat file_info;
+   if (atomic_load(&num_unflushed_buffers) == 0 ||
+       fstat(fd, &file_info) == -1 || !S_ISREG(file_info.st_mode))
+   {
+      return;
+   }
+   for (int other_fd = 0; other_fd < MAX_BUFFERED_FDS; other_fd++)
+   {
+      write_buffer* buffer = &write_buffers[other_fd];
+      if (buffer->count != 0 && buffer->device == file_info.st_dev && buffer->inode == file_info.st_ino)
+      {
+         flush_write_buffer(other_fd);
+      }
+   }
+}
+
+// Each worker owns a lane of file descriptors, so operations on the
+// same fd still happen in the order they arrived while a slow fd only
+// holds up its own lane. stdin has a lane to itself, a RED waiting on
+// the user must not hold up any file.
+#define STDIN_LANE NUM_IO_WORKERS
+#define NUM_IO_LANES (NUM_IO_WORKERS + 1)
+#define ALL_LANES -1
+
+static int fd_lane(int fd)
+{
+   if (fd == STDIN_FILENO)
+   {
+      return STDIN_LANE;
+   }
+   return (uint32_t)fd % NUM_IO_WORKERS;
+}
+
+// Every fd in lane, or all of them with ALL_LANES
+static void flush_write_buffers(int lane)
+{
+   for (int fd = 0; fd < MAX_BUFFERED_FDS; fd++)
+   {
+      if (write_buffers[fd].count != 0 && (lane == ALL_LANES || fd_lane(fd) == lane))
+      {
+         flush_write_buffer(fd);
+      }
+   }
+}
+
+// Flush fd and forget what we knew about it, fd is being closed or
+// was just opened
+static void reset_write_buffer(int fd)
+{
+   if (fd < 0 || fd >= MAX_BUFFERED_FDS)
+   {
+      return;
+   }
+
+   write_buffer* buffer = &write_buffers[fd];
+   pthread_mutex_lock(&buffer->lock);
+   flush_write_buffer_locked(fd, buffer);
+   buffer->checked = false;
+   pthread_mutex_unlock(&buffer->lock);
+}
 
-            next.opcode = DUP;
-            next.data_1 = new_fd;
+// write(), what goes to stdout is also kept for the snapshot
+static ssize_t unbuffered_write(int fd, char* data, size_t count)
+{
+   ssize_t result = write(fd, data, count);
+   if (fd == STDOUT_FILENO && result > 0)
+   {
+      checkpoint_wrote_output(data, result);
+   }
+   return result;
+}
+
+// Same results as write(fd, data, count), count is at most WRITE_BEHIND_SIZE
+static ssize_t buffered_write(int fd, char* data, size_t count)
+{
+   if (fd <= STDERR_FILENO || fd >= MAX_BUFFERED_FDS)
+   {
+      return unbuffered_write(fd, data, count);
+   }
+
+   ssize_t result = count;
+   write_buffer* buffer = &write_buffers[fd];
+   pthread_mutex_lock(&buffer->lock);
+   if (!buffer->checked)
+   {
+      struct stat file_info;
+      int flags = fcntl(fd, F_GETFL);
+      buffer->buffered = flags != -1 && (flags & O_ACCMODE) != O_RDONLY &&
+         fstat(fd, &file_info) == 0 && S_ISREG(file_info.st_mode);
+      if (buffer->buffered)
+      {
+         buffer->device = file_info.st_dev;
+         buffer->inode = file_info.st_ino;
+      }
+      buffer->checked = true;
+   }
+
+   if (!buffer->buffered)
+   {
+      result = write(fd, data, count);
+      goto done;
+   }
+
+   if (buffer->data == NULL)
+   {
+      buffer->data = (char*)malloc(WRITE_BEHIND_SIZE);
+   }
+   if (buffer->count + count > WRITE_BEHIND_SIZE && !flush_write_buffer_locked(fd, buffer))
+   {
+      result = -1;
+      goto done;
+   }
+   if (buffer->count == 0)
+   {
+      atomic_fetch_add(&num_unflushed_buffers, 1);
+   }
+   memcpy(buffer->data + buffer->count, data, count);
+   buffer->count += count;
+
+  done:
+   pthread_mutex_unlock(&buffer->lock);
+   return result;
+}
+
+// write() all of data, returns 1 or the failing write()'s result
+static int write_all(int fd, char* data, size_t count)
+{
+   while (count > 0)
+   {
+      ssize_t result = unbuffered_write(fd, data, count);
+      if (result <= 0)
+      {
+         return result;
+      }
+      data += result;
+      count -= result;
+   }
+   return 1;
+}
+
+static int compare_names(const void* a, const void* b)
+{
+   return strcoll(*(char* const*)a, *(char* const*)b);
+}
+
+// The io_switch's input, for input handler tokens and LS output
+static queue* token_output = NULL;
+
+// What /bin/ls in the current directory printed (one name per line,
+// sorted, no dotfiles), without forking a shell and ls. Returns what
+// system() would have: 0, or ls's exit status 2 in the high byte.
+static int list_directory()
+{
+   DIR* dir = opendir(".");
+   if (dir == NULL)
+   {
+      #ifdef DEBUG
+      perror("Input_module: opendir");
+      #endif
+      return 2 << 8;
+   }
+
+   size_t num_names = 0;
+   size_t max_names = 64;
+   size_t listing_size = 0;
+   char** names = (char**)malloc(sizeof(char*) * max_names);
+   struct dirent* entry;
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (entry->d_name[0] == '.')
+      {
+         continue;
+      }
+      if (num_names == max_names)
+      {
+         max_names *= 2;
+         names = (char**)realloc(names, sizeof(char*) * max_names);
+      }
+      names[num_names] = strdup(entry->d_name);
+      listing_size += strlen(entry->d_name) + 1;
+      num_names++;
+   }
+   closedir(dir);
+
+   qsort(names, num_names, sizeof(char*), compare_names);
+
+   char* listing = (char*)malloc(listing_size + 1);
+   char* next = listing;
+   for (size_t i = 0; i < num_names; i++)
+   {
+      size_t length = strlen(names[i]);
+      memcpy(next, names[i], length);
+      next[length] = '\n';
+      next += length + 1;
+      free(names[i]);
+   }
+   free(names);
+
+   // Out through the io_switch's output buffer like OUTS, so it stays
+   // in order with the output buffered there. OUTS stops at the first
+   // NUL, so a token carries at most 7 bytes.
+   size_t chunk = sizeof(data_type) - 1;
+   size_t num_tokens = (listing_size + chunk - 1) / chunk;
+   token_type* tokens = (token_type*)calloc(num_tokens + 1, sizeof(token_type));
+   for (size_t i = 0; i < num_tokens; i++)
+   {
+      size_t length = listing_size - i * chunk;
+      if (length > chunk)
+      {
+         length = chunk;
+      }
+      tokens[i].destination = OUTPUTS_DESTINATION;
+      tokens[i].tag = NO_TAG;
+      memcpy(&tokens[i].data, listing + i * chunk, length);
+   }
+   if (num_tokens != 0)
+   {
+      queue_add_many(token_output, tokens, num_tokens, sizeof(token_type));
+   }
+   free(tokens);
+   free(listing);
+   return 0;
+}
+
+typedef enum {COPY_FILE_RANGE, SENDFILE, SPLICE, CHUNKED} copy_method;
+
+// Copy in_fd to out_fd until EOF (0) or an error (-1, or 0 if a write
+// wrote nothing), letting the kernel move the data when the fd types
+// allow it.
+static int copy_fd_contents(int in_fd, int out_fd)
+{
+   struct stat in_info, out_info;
+   bool in_ok = fstat(in_fd, &in_info) == 0;
+   bool out_ok = fstat(out_fd, &out_info) == 0;
+
+   copy_method method = CHUNKED;
+   if (in_ok && out_ok && S_ISREG(in_info.st_mode) && S_ISREG(out_info.st_mode))
+   {
+      method = COPY_FILE_RANGE;
+   }
+   else if (in_ok && S_ISREG(in_info.st_mode))
+   {
+      method = SENDFILE;
+   }
+   else if ((in_ok && S_ISFIFO(in_info.st_mode)) || (out_ok && S_ISFIFO(out_info.st_mode)))
+   {
+      method = SPLICE;
+   }
+   // stdout has to go through here to be kept for the snapshot
+   if (checkpoint != NULL && out_fd == STDOUT_FILENO)
+   {
+      method = CHUNKED;
+   }
+
+   while (1)
+   {
+      ssize_t copied;
+      switch(method)
+      {
+         case COPY_FILE_RANGE:
+            copied = copy_file_range(in_fd, NULL, out_fd, NULL, SDF_CHUNK_SIZE, 0);
             break;
-         }
 
-         case RED: {
-            int fd = next.data_1;
-            char input;
-            int result = read(fd, &input, 1);
-            #ifdef DEBUG
-            fprintf(stderr, "Input_module: Reading from fd %d got %c with result %d\n", fd, input, result);
-            if (result == -1)
-            {
-               perror("read fail");
-            }
-            #endif
+         case SENDFILE:
+            copied = sendfile(out_fd, in_fd, NULL, SDF_CHUNK_SIZE);
+            break;
 
-            next.opcode = DUP;
-            if (result == 1)
-            {
-               next.data_1 = (unsigned char)input;
-            }
-            else 
+         case SPLICE:
+            copied = splice(in_fd, NULL, out_fd, NULL, SDF_CHUNK_SIZE, SPLICE_F_MOVE);
+            break;
+
+         default: {
+            char chunk[SDF_CHUNK_SIZE];
+            copied = read(in_fd, chunk, SDF_CHUNK_SIZE);
+            if (copied > 0)
             {
-               next.data_1 = -1;
+               int result = write_all(out_fd, chunk, copied);
+               if (result != 1)
+               {
+                  return result;
+               }
             }
             break;
          }
+      }
 
-         case WRT: {
-            int fd = next.data_1;
-            char to_write = next.data_2;
-            int result = write(fd, &to_write, 1);
-            #ifdef DEBUG
-            fprintf(stderr, "Input_module: Writing to fd %d a %c with result %d\n", fd, to_write, result);
-            #endif
+      if (copied == 0)
+      {
+         return 0;
+      }
+      if (copied < 0)
+      {
+         // The kernel can't do it for this pair of fds, nothing was
+         // copied so fall back to something more general
+         if (method != CHUNKED && (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP))
+         {
+            method = (method == COPY_FILE_RANGE) ? SENDFILE : CHUNKED;
+            continue;
+         }
+         return -1;
+      }
+   }
+}
 
-            next.opcode = DUP;
-            if (result == 1)
-            {
-               next.data_1 = TRUE;
-            }
-            else
-            {
-               next.data_1 = FALSE;
-            }
-            break;
+// Same results as the old byte at a time read/write loop: 0 once
+// in_fd hits EOF, otherwise the failing read or write's result
+static int send_file(int in_fd, int out_fd)
+{
+   flush_writes_to_file(in_fd);
+   flush_write_buffer(out_fd);
+   drop_read_buffer(out_fd, true);
+
+   if (in_fd < 0 || in_fd >= MAX_BUFFERED_FDS)
+   {
+      return copy_fd_contents(in_fd, out_fd);
+   }
+
+   // Whatever was read ahead goes first. Keep in_fd's buffer locked
+   // throughout so that no RED can slip in between.
+   int result;
+   read_buffer* buffer = &read_buffers[in_fd];
+   pthread_mutex_lock(&buffer->lock);
+   wait_for_reads(buffer);
+   if (buffer->end != buffer->start)
+   {
+      result = write_all(out_fd, buffer->data + buffer->start, buffer->end - buffer->start);
+      buffer->start = 0;
+      buffer->end = 0;
+      if (result != 1)
+      {
+         goto done;
+      }
+   }
+   result = copy_fd_contents(in_fd, out_fd);
+
+  done:
+   pthread_mutex_unlock(&buffer->lock);
+   return result;
+}
+
+static execution_packet execute_io_packet(execution_packet next)
+{
+   switch(next.opcode)
+   {
+      case OPN: {
+         char filename[9];
+         int machine_flags = (int)next.data_2;
+         strncpy(filename, (char*)&next.data_1, 8);
+         filename[8] = '\0';
+
+         int os_flags = 0;
+
+         if (FLAG_TO_RW_MODE(machine_flags) == FILE_READ_ONLY)
+         {
+            os_flags |= O_RDONLY;
+         }
+         else if (FLAG_TO_RW_MODE(machine_flags) == FILE_WRITE_ONLY)
+         {
+            os_flags |= O_WRONLY;
+         }
+         else if (FLAG_TO_RW_MODE(machine_flags) == FILE_READ_WRITE)
+         {
+            os_flags |= O_RDWR;
          }
 
-         case CLS: {
-            int fd = next.data_1;
-            int result = close(fd);
-            #ifdef DEBUG
-            fprintf(stderr, "Input_module: Closing fd %d with result %d\n", fd, result);
-            #endif
+         if ((machine_flags & FILE_CREATE) != 0)
+         {
+            os_flags |= O_CREAT;
+         }
+         if ((machine_flags & FILE_TRUNCATE) != 0)
+         {
+            os_flags |= O_TRUNC;
+         }
 
-            next.opcode = DUP;
-            if (result == 0)
-            {
-               next.data_1 = TRUE;
-            }
-            else
-            {
-               next.data_1 = FALSE;
-            }
-            break;
+         // The file may be one we are still holding writes for
+         flush_write_buffers(ALL_LANES);
+         int new_fd = open(filename, os_flags, 0600);
+         drop_read_buffer(new_fd, false);
+         reset_write_buffer(new_fd);
+         #ifdef DEBUG
+         fprintf(stderr, "Input_module: Opening file %s with os_flags %p new_fd=%d\n", filename, os_flags, new_fd);
+         #endif
+
+         next.opcode = DUP;
+         next.data_1 = new_fd;
+         break;
+      }
+
+      case RED: {
+         int fd = next.data_1;
+         char input;
+         flush_writes_to_file(fd);
+         int result = buffered_read(fd, &input);
+         #ifdef DEBUG
+         fprintf(stderr, "Input_module: Reading from fd %d got %c with result %d\n", fd, input, result);
+         if (result == -1)
+         {
+            perror("read fail");
          }
-         case LS: {
-            int result = system("/bin/ls");
-            next.opcode = DUP;
-            next.data_1 = result;
-            break;
+         #endif
+
+         next.opcode = DUP;
+         if (result == 1)
+         {
+            next.data_1 = (unsigned char)input;
          }
-         case SDF: {
-            int in_fd = next.data_1;
-            int out_fd = next.data_2;
-            char input;
-            int result = read(in_fd, &input, 1);
-            while (result == 1)
-            {
-               result = write(out_fd, &input, 1);
-               if (result == 1)
-               {
-                  result = read(in_fd, &input, 1);
-               }
-            }
+         else 
+         {
+            next.data_1 = -1;
+         }
+         break;
+      }
 
-            #ifdef DEBUG
-            fprintf(stderr, "Input_module: Sendfile from %d to %d resulted in %d\n", in_fd, out_fd, result);
-            #endif
-            next.opcode = DUP;
-            next.data_1 = result;
-            break;
+      case WRT: {
+         int fd = next.data_1;
+         char to_write = next.data_2;
+         drop_read_buffer(fd, true);
+         int result = buffered_write(fd, &to_write, 1);
+         #ifdef DEBUG
+         fprintf(stderr, "Input_module: Writing to fd %d a %c with result %d\n", fd, to_write, result);
+         #endif
+
+         next.opcode = DUP;
+         if (result == 1)
+         {
+            next.data_1 = TRUE;
+         }
+         else
+         {
+            next.data_1 = FALSE;
          }
-         case ULK: {
-            char filename[9];
-            strncpy(filename, (char*)&next.data_1, 8);
-            filename[8] = '\0';
-            int result = unlink(filename);
+         break;
+      }
 
-            #ifdef DEBUG
-            fprintf(stderr, "Input_module: Unlink file %s resulted in %d\n", filename, result);
-            #endif
+      case CLS: {
+         int fd = next.data_1;
+         drop_read_buffer(fd, false);
+         reset_write_buffer(fd);
+         int result = close(fd);
+         #ifdef DEBUG
+         fprintf(stderr, "Input_module: Closing fd %d with result %d\n", fd, result);
+         #endif
 
-            next.opcode = DUP;
-            next.data_1 = result;
-            break;
+         next.opcode = DUP;
+         if (result == 0)
+         {
+            next.data_1 = TRUE;
+         }
+         else
+         {
+            next.data_1 = FALSE;
          }
-         case LSK: {
-            int fd = next.data_1;
-            off_t offset = next.data_2;
-            off_t result = lseek(fd, offset, SEEK_SET);
+         break;
+      }
+      case LS: {
+         int result = list_directory();
+         next.opcode = DUP;
+         next.data_1 = result;
+         break;
+      }
+      case SDF: {
+         int in_fd = next.data_1;
+         int out_fd = next.data_2;
+         int result = send_file(in_fd, out_fd);
+
+         #ifdef DEBUG
+         fprintf(stderr, "Input_module: Sendfile from %d to %d resulted in %d\n", in_fd, out_fd, result);
+         #endif
+         next.opcode = DUP;
+         next.data_1 = result;
+         break;
+      }
+      case ULK: {
+         char filename[9];
+         strncpy(filename, (char*)&next.data_1, 8);
+         filename[8] = '\0';
+         int result = unlink(filename);
 
-            #ifdef DEBUG
-            fprintf(stderr, "Input_module: lseek fd %d offset %d result %d\n", fd, offset, result);
-            #endif
+         #ifdef DEBUG
+         fprintf(stderr, "Input_module: Unlink file %s resulted in %d\n", filename, result);
+         #endif
 
-            next.opcode = DUP;
-            next.data_1 = result;
-            break;
+         next.opcode = DUP;
+         next.data_1 = result;
+         break;
+      }
+      case LSK: {
+         int fd = next.data_1;
+         off_t offset = next.data_2;
+         drop_read_buffer(fd, false);
+         flush_write_buffer(fd);
+         off_t result = lseek(fd, offset, SEEK_SET);
+
+         #ifdef DEBUG
+         fprintf(stderr, "Input_module: lseek fd %d offset %d result %d\n", fd, offset, result);
+         #endif
+
+         next.opcode = DUP;
+         next.data_1 = result;
+         break;
+      }
+
+      case RDW: {
+         // Like num REDs, packed first byte first. -1 on EOF.
+         int fd = next.data_1;
+         int num = next.data_2;
+         if (num < 1)
+         {
+            num = 1;
+         }
+         else if (num > 8)
+         {
+            num = 8;
          }
 
-         default:
-            break;
+         flush_writes_to_file(fd);
+         data_type word = 0;
+         int result = 1;
+         for (int i = 0; i < num && result == 1; i++)
+         {
+            char input;
+            result = buffered_read(fd, &input);
+            word = (word << 8) ^ (unsigned char)input;
+         }
+         #ifdef DEBUG
+         fprintf(stderr, "Input_module: Reading %d bytes from fd %d got %lx with result %d\n", num, fd, word, result);
+         #endif
+
+         next.opcode = DUP;
+         next.data_1 = (result == 1) ? word : -1;
+         break;
+      }
+
+      case WRW: {
+         // The low half of data_1 is the fd, the high half how many
+         // bytes of data_2 to write, lowest byte first (the way
+         // strings are packed)
+         int fd = next.data_1 & 0xffffffff;
+         size_t count = next.data_1 >> 32;
+         if (count > 8)
+         {
+            count = 8;
+         }
+
+         char bytes[8];
+         for (int i = 0; i < 8; i++)
+         {
+            bytes[i] = (next.data_2 >> (i * 8)) & 0xff;
+         }
+         drop_read_buffer(fd, true);
+         ssize_t result = 0;
+         if (count > 0)
+         {
+            result = buffered_write(fd, bytes, count);
+         }
+         #ifdef DEBUG
+         fprintf(stderr, "Input_module: Writing %zd bytes to fd %d with result %zd\n", count, fd, result);
+         #endif
+
+         next.opcode = DUP;
+         next.data_1 = result;
+         break;
+      }
+
+      default:
+         break;
+   }
+   return next;
+}
+
+static uint32_t io_packet_lane(execution_packet* packet)
+{
+   switch(packet->opcode)
+   {
+      case OPN:
+      case ULK:
+         // By filename, so an unlink stays ordered with an open of the same file
+         return ((packet->data_1 * 0x9E3779B97F4A7C15ULL) >> 32) % NUM_IO_WORKERS;
+
+      case LS:
+         // ls writes to stdout
+         return fd_lane(STDOUT_FILENO);
+
+      case SDF:
+         // Keep the output ordered with writes to the same fd
+         return fd_lane(packet->data_2);
+
+      default:
+         // WRW keeps more than the fd in the high half
+         return fd_lane(packet->data_1);
+   }
+}
+
+typedef struct {
+   int lane;
+   queue* pending_packets;
+   queue* processed_executable_packet_queue;
+   pthread_t thread;
+} io_worker;
+
+// Writes are flushed once a worker has had nothing to do for
+// WRITE_BEHIND_IDLE_NS. A WRT usually arrives alone, so flushing as
+// soon as the queue is empty would not coalesce anything.
+static bool flush_writes_when_idle(io_worker* worker)
+{
+   if (queue_wait_timed(worker->pending_packets, WRITE_BEHIND_IDLE_NS))
+   {
+      return false;
+   }
+   flush_write_buffers(worker->lane);
+   return true;
+}
+
+// Registered input handlers, protected by input_handlers_lock. Data
+// arriving on a registered fd is pushed to the execution token output
+// queue as if a processing unit had produced it.
+typedef struct {
+   bool registered;
+   bool words;
+   destination_type destination;
+   tag_type tag;
+} input_handler;
+
+static input_handler input_handlers[MAX_BUFFERED_FDS];
+static pthread_mutex_t input_handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+static int input_handlers_epoll = -1;
+
+static void remove_input_handler(int fd)
+{
+   pthread_mutex_lock(&input_handlers_lock);
+   if (input_handlers[fd].registered)
+   {
+      epoll_ctl(input_handlers_epoll, EPOLL_CTL_DEL, fd, NULL);
+      input_handlers[fd].registered = false;
+   }
+   pthread_mutex_unlock(&input_handlers_lock);
+}
+
+// Push whatever fd has for us (one read's worth, or what is left in
+// its read-ahead buffer). Returns false once fd hit EOF or an error,
+// the handler is removed then.
+static bool push_input(int fd, queue_batch* tokens)
+{
+   pthread_mutex_lock(&input_handlers_lock);
+   input_handler handler = input_handlers[fd];
+   pthread_mutex_unlock(&input_handlers_lock);
+   if (!handler.registered)
+   {
+      return false;
+   }
+
+   char input[READ_AHEAD_SIZE];
+   ssize_t num_read;
+   read_buffer* buffer = &read_buffers[fd];
+   pthread_mutex_lock(&buffer->lock);
+   if (buffer->reading)
+   {
+      // A RED is in read() and gets what fd has, don't wait for it
+      pthread_mutex_unlock(&buffer->lock);
+      return true;
+   }
+   if (buffer->start != buffer->end)
+   {
+      num_read = buffer->end - buffer->start;
+      memcpy(input, buffer->data + buffer->start, num_read);
+      buffer->start = 0;
+      buffer->end = 0;
+   }
+   else
+   {
+      // A RED may have taken what epoll saw, don't block in read()
+      struct pollfd ready = {.fd = fd, .events = POLLIN};
+      if (poll(&ready, 1, 0) != 1)
+      {
+         pthread_mutex_unlock(&buffer->lock);
+         return true;
+      }
+      num_read = read_unlocked(fd, buffer, input, READ_AHEAD_SIZE);
+   }
+   pthread_mutex_unlock(&buffer->lock);
+
+   token_type token = {
+      .destination = handler.destination,
+      .tag = handler.tag,
+   };
+   ssize_t i = 0;
+   while (i < num_read)
+   {
+      token.data = 0;
+      int chunk = handler.words ? 8 : 1;
+      for (int j = 0; j < chunk && i < num_read; j++, i++)
+      {
+         token.data |= (data_type)(unsigned char)input[i] << (j * 8);
+      }
+      queue_batch_add(tokens, &token, sizeof(token_type));
+   }
+
+   bool more = num_read > 0;
+   if (!more)
+   {
+      #ifdef DEBUG
+      fprintf(stderr, "Input_module: input handler for fd %d done with %zd\n", fd, num_read);
+      #endif
+      remove_input_handler(fd);
+      token.data = -1;
+      queue_batch_add(tokens, &token, sizeof(token_type));
+   }
+   queue_batch_flush(tokens);
+   return more;
+}
+
+static void add_input_handler(token_type request, queue_batch* tokens)
+{
+   int fd = INPUT_HANDLER_TO_FD(request.data);
+   token_type eof = {
+      .data = -1,
+      .destination = INPUT_HANDLER_TO_DESTINATION(request.data),
+      .tag = request.tag,
+   };
+   if (fd >= MAX_BUFFERED_FDS)
+   {
+      queue_batch_add(tokens, &eof, sizeof(token_type));
+      queue_batch_flush(tokens);
+      return;
+   }
+
+   pthread_mutex_lock(&input_handlers_lock);
+   input_handlers[fd].registered = true;
+   input_handlers[fd].words = (request.data & INPUT_HANDLER_WORDS) != 0;
+   input_handlers[fd].destination = INPUT_HANDLER_TO_DESTINATION(request.data);
+   input_handlers[fd].tag = request.tag;
+
+   struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+   int result = epoll_ctl(input_handlers_epoll, EPOLL_CTL_ADD, fd, &event);
+   if (result == -1 && errno == EEXIST)
+   {
+      result = epoll_ctl(input_handlers_epoll, EPOLL_CTL_MOD, fd, &event);
+   }
+   pthread_mutex_unlock(&input_handlers_lock);
+
+   if (result == -1)
+   {
+      // Regular files can't be polled, they are always ready so send
+      // everything now. Anything else (a bad fd) just gets the EOF.
+      #ifdef DEBUG
+      perror("Input_module: epoll_ctl");
+      #endif
+      if (errno != EPERM)
+      {
+         remove_input_handler(fd);
+         queue_batch_add(tokens, &eof, sizeof(token_type));
+         queue_batch_flush(tokens);
+         return;
+      }
+      while (push_input(fd, tokens))
+      {
+      }
+   }
+}
+
+// Takes requests from the io switch
+static void* run_input_handler_requests(void* arg)
+{
+   queue* requests = (queue*)arg;
+   token_type request;
+   queue_batch tokens;
+   queue_batch_init(&tokens, token_output, QUEUE_BURST_SIZE, sizeof(token_type));
+   while (1)
+   {
+      queue_remove(requests, &request, sizeof(token_type));
+      if (request.destination == REGISTER_INPUT_HANDLER_DESTINATION)
+      {
+         add_input_handler(request, &tokens);
+      }
+      else if (request.data < MAX_BUFFERED_FDS)
+      {
+         remove_input_handler(request.data);
+      }
+   }
+   return NULL;
+}
+
+static void* run_input_handlers(void* arg)
+{
+   struct epoll_event events[MAX_INPUT_HANDLER_EVENTS];
+   queue_batch tokens;
+   queue_batch_init(&tokens, token_output, QUEUE_BURST_SIZE, sizeof(token_type));
+   while (1)
+   {
+      int num_events = epoll_wait(input_handlers_epoll, events, MAX_INPUT_HANDLER_EVENTS, -1);
+      for (int i = 0; i < num_events; i++)
+      {
+         push_input(events[i].data.fd, &tokens);
+      }
+   }
+   return NULL;
+}
+
+// SIGTERM is how start_machine shuts us down, write out what is
+// buffered before going.
+static void* run_shutdown_handler(void* arg)
+{
+   sigset_t* signals = (sigset_t*)arg;
+   int signal;
+   sigwait(signals, &signal);
+   flush_write_buffers(ALL_LANES);
+   _exit(0);
+   return NULL;
+}
+
+// While checkpointing, the machine stops where it would wait for stdin.
+// Input that was already read ahead is used up first, the snapshot
+// doesn't keep it.
+static bool waits_for_stdin(execution_packet* packet)
+{
+   if ((packet->opcode != RED && packet->opcode != RDW) || (int)packet->data_1 != STDIN_FILENO)
+   {
+      return false;
+   }
+   read_buffer* buffer = &read_buffers[STDIN_FILENO];
+   pthread_mutex_lock(&buffer->lock);
+   bool empty = buffer->start == buffer->end && !buffer->reading;
+   pthread_mutex_unlock(&buffer->lock);
+   return empty;
+}
+
+static void* run_io_worker(void* arg)
+{
+   io_worker* worker = (io_worker*)arg;
+   execution_packet packets[QUEUE_BURST_SIZE];
+   queue_batch processed_packets;
+   queue_batch_init(&processed_packets, worker->processed_executable_packet_queue, QUEUE_BURST_SIZE, sizeof(execution_packet));
+   bool pending_writes = false;
+
+   while(1)
+   {
+      if (pending_writes)
+      {
+         pending_writes = !flush_writes_when_idle(worker);
+      }
+
+      unsigned long num_packets = queue_remove_many(worker->pending_packets, packets, QUEUE_BURST_SIZE, sizeof(execution_packet));
+
+      for (unsigned long i = 0; i < num_packets; i++)
+      {
+         // I/O can block (think stdin), so don't hold back the
+         // packets that are already done while it does.
+         queue_batch_flush(&processed_packets);
+         if (checkpoint != NULL && waits_for_stdin(&packets[i]) && checkpoint_hold_packet(packets[i]))
+         {
+            continue;
+         }
+         pending_writes |= packets[i].opcode == WRT || packets[i].opcode == WRW;
+         execution_packet next = execute_io_packet(packets[i]);
+         queue_batch_add(&processed_packets, &next, sizeof(execution_packet));
+      }
+      queue_batch_flush(&processed_packets);
+      checkpoint_finished_work(num_packets);
+   }
+   return NULL;
+}
+
+void run_input_module(queue* preprocessed_executable_packet_queue, queue* processed_executable_packet_queue, queue* input_handler_requests, queue* execution_token_output_queue)
+{
+   init_read_buffers();
+   init_write_buffers();
+
+   // Only the shutdown handler takes SIGTERM, the workers inherit the mask
+   static sigset_t shutdown_signals;
+   pthread_t shutdown_handler;
+   sigemptyset(&shutdown_signals);
+   sigaddset(&shutdown_signals, SIGTERM);
+   pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+   pthread_create(&shutdown_handler, NULL, run_shutdown_handler, &shutdown_signals);
+
+   token_output = execution_token_output_queue;
+   input_handlers_epoll = epoll_create1(0);
+   pthread_t input_handler_threads[2];
+   if (input_handlers_epoll == -1 ||
+       pthread_create(&input_handler_threads[0], NULL, run_input_handler_requests, input_handler_requests) != 0 ||
+       pthread_create(&input_handler_threads[1], NULL, run_input_handlers, NULL) != 0)
+   {
+      #ifdef DEBUG
+      perror("Error starting the input handlers");
+      #endif
+      exit(-1);
+   }
+
+   io_worker workers[NUM_IO_LANES];
+   queue_batch pending_packets[NUM_IO_LANES];
+   for (int i = 0; i < NUM_IO_LANES; i++)
+   {
+      workers[i].lane = i;
+      workers[i].pending_packets = queue_new(IO_WORKER_QUEUE_SIZE, sizeof(execution_packet), QUEUE_SPSC);
+      workers[i].processed_executable_packet_queue = processed_executable_packet_queue;
+      queue_batch_init(&pending_packets[i], workers[i].pending_packets, QUEUE_BURST_SIZE, sizeof(execution_packet));
+      if (pthread_create(&workers[i].thread, NULL, run_io_worker, &workers[i]) != 0)
+      {
+         #ifdef DEBUG
+         perror("Error starting an I/O worker");
+         #endif
+         exit(-1);
+      }
+   }
+
+   execution_packet packets[QUEUE_BURST_SIZE];
+   while(1)
+   {
+      unsigned long num_packets = queue_remove_many(preprocessed_executable_packet_queue, packets, QUEUE_BURST_SIZE, sizeof(execution_packet));
+      // The workers finish these
+      checkpoint_took_work(num_packets);
+
+      for (unsigned long i = 0; i < num_packets; i++)
+      {
+         queue_batch_add(&pending_packets[io_packet_lane(&packets[i])], &packets[i], sizeof(execution_packet));
+      }
+      for (int i = 0; i < NUM_IO_LANES; i++)
+      {
+         queue_batch_flush(&pending_packets[i]);
       }
-      queue_add(processed_executable_packet_queue, &next, sizeof(execution_packet));
    }
 }
@@ -1,6 +1,8 @@
 #ifndef INPUT_MODULE_H
 #define INPUT_MODULE_H
 
+#include <stdbool.h>
+
 #include "types.h"
 #include "queue.h"
 
@@ -12,6 +14,22 @@
 #define FILE_CREATE 0x10
 #define FILE_TRUNCATE 0x20
 
-void run_input_module(queue* preprocessed_executable_packet_queue, queue* processed_executable_packet_queue);
+// I/O is done by a pool of threads in the input module, plus one
+// that only does stdin
+#define NUM_IO_WORKERS 4
+#define IO_WORKER_QUEUE_SIZE 256
+
+#define READ_AHEAD_SIZE (64 * 1024)
+#define WRITE_BEHIND_SIZE (64 * 1024)
+// How long a worker waits for more work before flushing its writes
+#define WRITE_BEHIND_IDLE_NS (1000 * 1000)
+#define MAX_BUFFERED_FDS 1024
+
+#define SDF_CHUNK_SIZE (64 * 1024)
+
+#define MAX_INPUT_HANDLER_EVENTS 16
+
+bool is_input_module_opcode(opcode_type opcode);
+void run_input_module(queue* preprocessed_executable_packet_queue, queue* processed_executable_packet_queue, queue* input_handler_requests, queue* execution_token_output_queue);
 
 #endif /* INPUT_MODULE_H */
@@ -1,33 +1,100 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include "checkpoint.h"
+#include "input_module.h"
 #include "instruction_store.h"
+#include "khash.h"
 
 instruction* instructions = NULL;
 uint32_t num_instructions = 0;
 
+// Every export in load order, and the first export of each name (the
+// keys are the nodes' names, nodes are never freed)
+KHASH_MAP_INIT_STR(export_index, export_node*)
+
 export_node* exports = NULL;
+static export_node* exports_tail = NULL;
+static khash_t(export_index)* export_names = NULL;
+
+// Only packets for I/O opcodes go through the input module, everything
+// else goes straight to the processing units
+typedef struct {
+   queue_batch input_module;
+   queue_batch processing_unit;
+} executable_packet_batches;
+
+static void add_executable_packet(executable_packet_batches* executable_packets, execution_packet* packet)
+{
+   if (is_input_module_opcode(packet->opcode))
+   {
+	  queue_batch_add(&executable_packets->input_module, packet, sizeof(execution_packet));
+   }
+   else
+   {
+	  queue_batch_add(&executable_packets->processing_unit, packet, sizeof(execution_packet));
+   }
+}
+
+static void flush_executable_packets(executable_packet_batches* executable_packets)
+{
+   queue_batch_flush(&executable_packets->processing_unit);
+   queue_batch_flush(&executable_packets->input_module);
+}
 
 export_node* find_export(char* name)
 {
-   export_node* cur = exports;
-   while (cur != NULL)
+   if (export_names == NULL)
    {
-	  if (strcmp(cur->name, name) == 0)
-	  {
-		 return cur;
-	  }
-	  cur = cur->next;
+	  return NULL;
    }
-   return NULL;
+   khint_t iter = kh_get(export_index, export_names, name);
+   if (iter == kh_end(export_names))
+   {
+	  return NULL;
+   }
+   return kh_value(export_names, iter);
+}
+
+static export_node* add_export(destination_type destination, char* name)
+{
+   export_node* new_export_node = (export_node*) malloc(sizeof(export_node));
+   new_export_node->current_destination = destination;
+   strcpy(new_export_node->name, name);
+   new_export_node->next = NULL;
+   if (exports_tail == NULL)
+   {
+	  exports = new_export_node;
+   }
+   else
+   {
+	  exports_tail->next = new_export_node;
+   }
+   exports_tail = new_export_node;
+
+   // Names that are exported again still resolve to the first export
+   if (export_names == NULL)
+   {
+	  export_names = kh_init(export_index);
+   }
+   int ret;
+   khint_t iter = kh_put(export_index, export_names, new_export_node->name, &ret);
+   if (ret != 0)
+   {
+	  kh_value(export_names, iter) = new_export_node;
+   }
+   return new_export_node;
 }
 
-void add_ready_instructions(instruction* instructions, uint32_t num_instructions, queue* executable_packet_queue)
+void add_ready_instructions(instruction* instructions, uint32_t num_instructions, tag_type tag, executable_packet_batches* executable_packets)
 {
    for (int i = 0; i < num_instructions; i++)
    {
@@ -38,13 +105,13 @@ void add_ready_instructions(instruction* instructions, uint32_t num_instructions
 			.data_1 = inst.literal_1,
 			.data_2 = inst.literal_2,
 			.opcode = inst.opcode,
-			.tag = NO_TAG,
+			.tag = tag,
 			.destination_1 = inst.destination_1,
 			.destination_2 = inst.destination_2,
             .input = CREATE_DESTINATION(i, 0, 0),
 			.marker = inst.marker,
 		 };
-		 queue_add(executable_packet_queue, &ready, sizeof(execution_packet));
+		 add_executable_packet(executable_packets, &ready);
 	  }
 	  else if (inst.instruction_literal == ONE &&
 			   opcode_to_num_inputs[inst.opcode] == 1)
@@ -53,42 +120,40 @@ void add_ready_instructions(instruction* instructions, uint32_t num_instructions
 			.data_1 = inst.literal_1,
 			.data_2 = 0,
 			.opcode = inst.opcode,
-			.tag = NO_TAG,
+			.tag = tag,
 			.destination_1 = inst.destination_1,
 			.destination_2 = inst.destination_2,
             .input = CREATE_DESTINATION(i, 0, 0),
 			.marker = inst.marker,
 		 };
-		 queue_add(executable_packet_queue, &ready, sizeof(execution_packet));
+		 add_executable_packet(executable_packets, &ready);
 	  }
    }
 }
 
-bool is_in_list(destination_to_update* constants, uint32_t num_constant, uint32_t cur, int which_destination)
+// Which destinations stay constant and which literals get relocated,
+// per instruction, so that relocating is one pass over the
+// instructions. Entries past the last instruction are ignored.
+static flags* relocation_flags(destination_to_update* constants, uint32_t num_constant, destination_to_update* to_fix, uint32_t num_to_fix, uint32_t num_instructions)
 {
-   for (int i = 0; i < num_constant; i++)
+   flags* to_return = (flags*)calloc(num_instructions + 1, sizeof(flags));
+   for (uint32_t i = 0; i < num_constant; i++)
    {
-	  if (constants[i].instruction_number == cur)
+	  if (constants[i].instruction_number < num_instructions)
 	  {
-		 if (which_destination == FIRST_DESTINATION && (constants[i].flags.is_first_destination))
-		 {
-			return true;
-		 }
-		 else if (which_destination == SECOND_DESTINATION && (constants[i].flags.is_second_destination))
-		 {
-			return true;
-		 }
-		 else if (which_destination == FIRST_LITERAL && (constants[i].flags.is_first_literal))
-		 {
-			return true;
-		 }
-		 else if (which_destination == SECOND_LITERAL && (constants[i].flags.is_second_literal))
-		 {
-			return true;
-		 }
+		 to_return[constants[i].instruction_number].is_first_destination |= constants[i].flags.is_first_destination;
+		 to_return[constants[i].instruction_number].is_second_destination |= constants[i].flags.is_second_destination;
 	  }
    }
-   return false;
+   for (uint32_t i = 0; i < num_to_fix; i++)
+   {
+	  if (to_fix[i].instruction_number < num_instructions)
+	  {
+		 to_return[to_fix[i].instruction_number].is_first_literal |= to_fix[i].flags.is_first_literal;
+		 to_return[to_fix[i].instruction_number].is_second_literal |= to_fix[i].flags.is_second_literal;
+	  }
+   }
+   return to_return;
 }
 
 int read_all(int fd, char* buf, int buf_size)
@@ -111,20 +176,69 @@ destination_type static inline increment_destination_address(destination_type de
 							 DESTINATION_TO_MATCHING_FUNCTION(destination));
 }
 
-loaded_code_info load_file(int fd, off_t file_size, bool is_privileged)
+// A file counts as unchanged while its inode, modification time and
+// size are
+typedef struct {
+   dev_t device;
+   ino_t inode;
+   struct timespec modified;
+   off_t file_size;
+} file_key;
+
+static bool get_file_key(int fd, file_key* key)
+{
+   struct stat info;
+   if (fstat(fd, &info) == -1)
+   {
+	  return false;
+   }
+   key->device = info.st_dev;
+   key->inode = info.st_ino;
+   key->modified = info.st_mtim;
+   key->file_size = info.st_size;
+   return true;
+}
+
+static bool same_file(file_key* key1, file_key* key2)
+{
+   return key1->device == key2->device &&
+	  key1->inode == key2->inode &&
+	  key1->modified.tv_sec == key2->modified.tv_sec &&
+	  key1->modified.tv_nsec == key2->modified.tv_nsec &&
+	  key1->file_size == key2->file_size;
+}
+
+// A parsed and checked program file, ready to be linked in at any base
+// address. The pointers point into content.
+typedef struct _program_image {
+   char* content;
+   external_reference* external_references;
+   uint32_t num_external_references;
+   export_symbol* exports;
+   uint32_t num_exports;
+   instruction* instructions;
+   uint32_t num_instructions;
+   flags* relocations;
+
+   file_key key;
+   struct _program_image* next;
+} program_image;
+
+static void free_program_image(program_image* image)
+{
+   free(image->relocations);
+   free(image->content);
+   free(image);
+}
+
+static program_image* parse_file(int fd, off_t file_size)
 {
-   loaded_code_info to_return = { .instructions = NULL,
-								  .current_num_instructions = 0,
-								  .exports = NULL,
-								  .error = 0
-   };
    if (file_size < sizeof(sephi_header))
    {
 	  #ifdef DEBUG
 	  fprintf(stderr, "Error: load_file file does not have enough size even for a header: %d\n", file_size);
 	  #endif
-	  to_return.error = -1;
-	  return to_return;
+	  return NULL;
    }
 
    // Read in the file
@@ -134,8 +248,7 @@ loaded_code_info load_file(int fd, off_t file_size, bool is_privileged)
 	  #ifdef DEBUG
 	  perror("Error: malloc failed");
 	  #endif
-	  to_return.error = -1;
-	  return to_return;
+	  return NULL;
    }
 
    char* end = content + file_size;
@@ -213,12 +326,55 @@ loaded_code_info load_file(int fd, off_t file_size, bool is_privileged)
 	  goto fail;
    }
 
-   int current_num_instructions = instruction_size / sizeof(instruction);
-
    for (uint32_t i = 0; i < num_external_references; i++)
    {
 	  external_references[i].name[REFERENCE_MAX_SIZE-1] = '\0';
+   }
+   for (uint32_t i = 0; i < num_exports; i++)
+   {
+	  this_exports[i].name[REFERENCE_MAX_SIZE-1] = '\0';
+   }
+
+   program_image* image = (program_image*)calloc(1, sizeof(program_image));
+   image->content = content;
+   image->external_references = external_references;
+   image->num_external_references = num_external_references;
+   image->exports = this_exports;
+   image->num_exports = num_exports;
+   image->instructions = start_instructions;
+   image->num_instructions = instruction_size / sizeof(instruction);
+   image->relocations = relocation_flags(constants, num_constant, to_fix, num_to_fix, image->num_instructions);
+   return image;
+
+  fail:
+   free(content);
+   return NULL;
+}
+
+// Relocate a copy of image to start in the instruction memory and link
+// it against the exports loaded so far. The copy is only put there by
+// add_instructions.
+static loaded_code_info link_image(program_image* image, uint32_t start, bool is_privileged)
+{
+   loaded_code_info to_return = { .instructions = NULL,
+								  .start = start,
+								  .current_num_instructions = 0,
+								  .exports = NULL,
+								  .num_exports = 0,
+								  .error = 0
+   };
+   external_reference* external_references = image->external_references;
+   uint32_t num_external_references = image->num_external_references;
+   int current_num_instructions = image->num_instructions;
+   flags* relocations = image->relocations;
+
+   instruction* relocated = NULL;
+
+   export_node** resolved = (export_node**)malloc(sizeof(export_node*) * (num_external_references + 1));
+   for (uint32_t i = 0; i < num_external_references; i++)
+   {
 	  export_node* result = find_export(external_references[i].name);
+	  resolved[i] = result;
 	  // check: do we have symbols for all the externed symbols?
 	  if (result == NULL)
 	  {
@@ -229,23 +385,22 @@ loaded_code_info load_file(int fd, off_t file_size, bool is_privileged)
 	  }
    }
 
-   int start_instruction_num = num_instructions;
-   instructions = (instruction*)realloc(instructions, instruction_size + (num_instructions * sizeof(instruction)));
-
-   num_instructions += current_num_instructions;
+   int start_instruction_num = start;
+   relocated = (instruction*)malloc(current_num_instructions * sizeof(instruction) + 1);
 
+   memcpy(relocated, image->instructions, current_num_instructions * sizeof(instruction));
    for (uint32_t i = 0; i < current_num_instructions; i++)
    {
 	  // update destinations unless it's in the constant tag. 
-	  instruction* inst = start_instructions+i;
-	  if (!is_in_list(constants, num_constant, i, FIRST_DESTINATION))
+	  instruction* inst = relocated+i;
+	  if (!relocations[i].is_first_destination)
 	  {
 		 if (inst->destination_1 != DEV_NULL_DESTINATION)
 		 {
 			inst->destination_1 = increment_destination_address(inst->destination_1, start_instruction_num);
 		 }
 	  }
-	  if (!is_in_list(constants, num_constant, i, SECOND_DESTINATION))
+	  if (!relocations[i].is_second_destination)
 	  {
 		 if (inst->destination_2 != DEV_NULL_DESTINATION)
 		 {
@@ -253,11 +408,11 @@ loaded_code_info load_file(int fd, off_t file_size, bool is_privileged)
 		 }
 	  }
 	  // Check about the to_fix ones
-	  if(is_in_list(to_fix, num_to_fix, i, FIRST_LITERAL))
+	  if (relocations[i].is_first_literal)
 	  {
 		 inst->literal_1 = increment_destination_address(inst->literal_1, start_instruction_num);
 	  }
-	  if(is_in_list(to_fix, num_to_fix, i, SECOND_LITERAL))
+	  if (relocations[i].is_second_literal)
 	  {
 		 inst->literal_2 = increment_destination_address(inst->literal_2, start_instruction_num);
 	  }
@@ -275,18 +430,19 @@ loaded_code_info load_file(int fd, off_t file_size, bool is_privileged)
              inst->opcode == SDF ||
              inst->opcode == ULK ||
              inst->opcode == LSK ||
-             inst->opcode == RND
+             inst->opcode == RND ||
+             inst->opcode == RDW ||
+             inst->opcode == WRW
             )
 		 {
 			inst->opcode = DUP;
 		 }
 	  }
-	  memcpy(instructions+start_instruction_num+i, start_instructions+i, sizeof(instruction));
    }
 
    for (uint32_t i = 0; i < num_external_references; i++)
    {
-	  export_node* result = find_export(external_references[i].name);
+	  export_node* result = resolved[i];
 
 	  // Now, resolve the external references.
 	  destination_to_update destination = external_references[i].destination;
@@ -299,7 +455,7 @@ loaded_code_info load_file(int fd, off_t file_size, bool is_privileged)
 		 #endif
 		 goto fail;
 	  }
-	  instruction* inst = instructions+start_instruction_num+inst_num;
+	  instruction* inst = relocated+inst_num;
 	  if (destination.flags.is_first_destination)
 	  {
 		 inst->destination_1 = result->current_destination;
@@ -324,53 +480,546 @@ loaded_code_info load_file(int fd, off_t file_size, bool is_privileged)
    }
 
    // Update our store with the exports.
-
-   export_node* tail = exports;
    export_node* first_export = NULL;
-   while ((tail != NULL) && (tail->next != NULL))
-   {
-	  tail = tail->next;
-   }
-
-   for (uint32_t i = 0; i < num_exports; i++)
+   for (uint32_t i = 0; i < image->num_exports; i++)
    {
-	  export_symbol* export = this_exports+i;
-	  export->name[REFERENCE_MAX_SIZE-1] = '\0';
-	  export_node* new_export_node = (export_node*) malloc(sizeof(export_node));
-	  new_export_node->current_destination = increment_destination_address(export->local_destination, start_instruction_num);
-	  strcpy(new_export_node->name, export->name);
-	  new_export_node->next = NULL;
+	  export_symbol* export = image->exports+i;
+	  export_node* new_export_node = add_export(increment_destination_address(export->local_destination, start_instruction_num), export->name);
 	  if (first_export == NULL)
 	  {
 		 first_export = new_export_node;
 	  }
-	  if (tail == NULL)
-	  {
-		 tail = new_export_node;
-		 exports = tail;
-	  }
-	  else
-	  {
-		 tail->next = new_export_node;
-		 tail = new_export_node;
-	  }
    }
 
-   free(content);
-   to_return.instructions = instructions+start_instruction_num;
+   free(resolved);
+   to_return.instructions = relocated;
    to_return.current_num_instructions = current_num_instructions;
    to_return.exports = first_export;
+   to_return.num_exports = image->num_exports;
    to_return.error = 0;
    return to_return;
 
   fail:
-   free(content);
+   free(resolved);
+   free(relocated);
    to_return.error = -1;
    return to_return;
 
 }
 
-void run_instruction_store(char* os_filename, queue* ready_token_pair_queue, queue* executable_packet_queue)
+// Put code's relocated instructions in the instruction memory, at the
+// end where they were linked to start
+static void add_instructions(loaded_code_info* code)
+{
+   #ifdef DEBUG
+   assert(code->start == num_instructions);
+   #endif
+   instruction* relocated = code->instructions;
+   instructions = (instruction*)realloc(instructions, (num_instructions + code->current_num_instructions) * sizeof(instruction));
+   memcpy(instructions+code->start, relocated, code->current_num_instructions * sizeof(instruction));
+   num_instructions += code->current_num_instructions;
+   free(relocated);
+   code->instructions = instructions+code->start;
+}
+
+loaded_code_info load_file(int fd, off_t file_size, bool is_privileged)
+{
+   loaded_code_info to_return = {.error = -1};
+   program_image* image = parse_file(fd, file_size);
+   if (image != NULL)
+   {
+	  to_return = link_image(image, num_instructions, is_privileged);
+	  free_program_image(image);
+   }
+   if (to_return.error != -1)
+   {
+	  add_instructions(&to_return);
+   }
+   return to_return;
+}
+
+// The same few programs are LODed over and over, so the last ones are
+// kept parsed
+static program_image* program_cache = NULL;
+
+static loaded_code_info link_cached_file(int fd, file_key* key, uint32_t start, bool is_privileged)
+{
+   loaded_code_info to_return = {.error = -1};
+   program_image* image = NULL;
+   for (program_image** cur = &program_cache; *cur != NULL; cur = &(*cur)->next)
+   {
+	  if (same_file(&(*cur)->key, key))
+	  {
+		 image = *cur;
+		 *cur = image->next;
+		 break;
+	  }
+   }
+
+   if (image == NULL)
+   {
+	  image = parse_file(fd, key->file_size);
+	  if (image == NULL)
+	  {
+		 return to_return;
+	  }
+	  image->key = *key;
+   }
+
+   // Most recently used first, drop whatever falls off the end
+   image->next = program_cache;
+   program_cache = image;
+   program_image* last = image;
+   for (int i = 1; i < PROGRAM_CACHE_SIZE && last->next != NULL; i++)
+   {
+	  last = last->next;
+   }
+   while (last->next != NULL)
+   {
+	  program_image* evicted = last->next;
+	  last->next = evicted->next;
+	  free_program_image(evicted);
+   }
+
+   return link_image(image, start, is_privileged);
+}
+
+loaded_code_info load_cached_file(int fd, bool is_privileged)
+{
+   loaded_code_info to_return = {.error = -1};
+   file_key key;
+   if (get_file_key(fd, &key))
+   {
+	  to_return = link_cached_file(fd, &key, num_instructions, is_privileged);
+   }
+   if (to_return.error != -1)
+   {
+	  add_instructions(&to_return);
+   }
+   return to_return;
+}
+
+// A program that LOD put in instruction memory. Once its main has
+// returned, the next LOD of the same file runs it again where it is
+// instead of appending another copy. It is still linked the same way,
+// exports are never removed.
+typedef struct _module {
+   file_key key;
+   uint32_t start;
+   uint32_t num_instructions;
+   // What LOD calls main through, NULL if the program has none
+   export_node* main_arg;
+   export_node* main_return_location;
+   bool running;
+   struct _module* next;
+} module;
+
+static module* modules = NULL;
+
+// Each run of a module gets a tag area of its own, so tokens left over
+// from an earlier run can never match the new run's in the same
+// instructions. main returns to MODULE_RETURN_DESTINATION, which
+// passes the result on to the LOD in the LOD's tag.
+typedef struct _running_module {
+   module_call call;
+   // NULL if the call was restored from a snapshot
+   module* mod;
+   struct _running_module* next;
+} running_module;
+
+static running_module* running_modules = NULL;
+static tag_area_type next_run_area = MODULE_TAG_AREA_BIT;
+
+static module* find_idle_module(file_key* key)
+{
+   module* cur = modules;
+   while (cur != NULL && (cur->running || !same_file(&cur->key, key)))
+   {
+	  cur = cur->next;
+   }
+   return cur;
+}
+
+static void add_running_module(module_call call, module* mod)
+{
+   running_module* running = (running_module*)malloc(sizeof(running_module));
+   running->call = call;
+   running->mod = mod;
+   running->next = running_modules;
+   running_modules = running;
+   if (call.area >= next_run_area)
+   {
+	  next_run_area = (call.area + 1) | MODULE_TAG_AREA_BIT;
+   }
+}
+
+static void module_returned(token_type result, executable_packet_batches* executable_packets)
+{
+   for (running_module** cur = &running_modules; *cur != NULL; cur = &(*cur)->next)
+   {
+	  running_module* returned = *cur;
+	  if (returned->call.area != TAG_TO_TAG_AREA(result.tag))
+	  {
+		 continue;
+	  }
+
+	  instruction inst = instructions[returned->call.address];
+	  execution_packet return_packet = {
+		 .data_1 = result.data,
+		 .data_2 = 0,
+		 .opcode = DUP,
+		 .tag = returned->call.return_tag,
+		 .destination_1 = inst.destination_1,
+		 .destination_2 = DEV_NULL_DESTINATION,
+		 .input = CREATE_DESTINATION(returned->call.address, 0, 0),
+		 .marker = ONE_OUTPUT_MARKER,
+	  };
+	  add_executable_packet(executable_packets, &return_packet);
+
+	  if (returned->mod != NULL)
+	  {
+		 returned->mod->running = false;
+	  }
+	  *cur = returned->next;
+	  free(returned);
+	  return;
+   }
+   #ifdef DEBUG
+   fprintf(stderr, "No module is running in tag area %u\n", TAG_TO_TAG_AREA(result.tag));
+   #endif
+}
+
+// Call the module's main for the LOD at address, as if the LOD's
+// tokens went to the main exports
+static void run_module(module* mod, uint32_t address, tag_type tag, data_type arg, executable_packet_batches* executable_packets)
+{
+   module_call call = {.area = next_run_area, .address = address, .return_tag = tag};
+   tag_type run_tag = CREATE_TAG(call.area, 0);
+   next_run_area = (call.area + 1) | MODULE_TAG_AREA_BIT;
+
+   // Without a main nothing returns from it, so it can run again
+   // right away
+   if (mod->main_arg != NULL && mod->main_return_location != NULL)
+   {
+	  mod->running = true;
+	  add_running_module(call, mod);
+
+	  // we good, let's add some fake packets to make it seem like we're calling this function
+	  execution_packet arg_packet = {
+		 .data_1 = arg,
+		 .data_2 = 0,
+		 .opcode = DUP,
+		 .tag = run_tag,
+		 .destination_1 = mod->main_arg->current_destination,
+		 .destination_2 = DEV_NULL_DESTINATION,
+		 .input = CREATE_DESTINATION(address, 0, 0),
+		 .marker = ONE_OUTPUT_MARKER,
+	  };
+	  add_executable_packet(executable_packets, &arg_packet);
+
+	  // now add the return value
+	  execution_packet return_loc = {
+		 .data_1 = MODULE_RETURN_DESTINATION,
+		 .data_2 = 0,
+		 .opcode = DUP,
+		 .tag = run_tag,
+		 .destination_1 = mod->main_return_location->current_destination,
+		 .destination_2 = DEV_NULL_DESTINATION,
+		 .input = CREATE_DESTINATION(address, 0, 0),
+		 .marker = ONE_OUTPUT_MARKER,
+	  };
+	  add_executable_packet(executable_packets, &return_loc);
+   }
+
+   add_ready_instructions(instructions + mod->start, mod->num_instructions, run_tag, executable_packets);
+}
+
+static void load_failed(uint32_t address, tag_type tag, executable_packet_batches* executable_packets)
+{
+   instruction inst = instructions[address];
+
+   // Change the packet so that the result of the load is a -1
+   execution_packet error_packet = {
+	  .data_1 = -1,
+	  .data_2 = 0,
+	  .opcode = DUP,
+	  .tag = tag,
+	  .destination_1 = inst.destination_1,
+	  .destination_2 = inst.destination_2,
+	  .input = CREATE_DESTINATION(address, 0, 0),
+	  .marker = inst.marker,
+   };
+   add_executable_packet(executable_packets, &error_packet);
+}
+
+/*
+  Programs are read, checked and relocated by the loader thread so the
+  instruction store keeps executing token pairs meanwhile. The loader
+  owns the program cache and the exports, and links each program to
+  start where the ones before it end. The instruction store adds the
+  loaded programs in the same order when the loader wakes it up with a
+  token pair to PROGRAM_LOADED_DESTINATION.
+*/
+#define MAX_PENDING_LOADS 256
+
+typedef struct {
+   int fd;
+   file_key key;
+   // The LOD
+   uint32_t address;
+   tag_type tag;
+   data_type arg;
+
+   loaded_code_info code;
+   export_node* main_arg;
+   export_node* main_return_location;
+} load_request;
+
+typedef struct {
+   queue* requests;
+   queue* loaded;
+   queue* ready_token_pair_queue;
+   // Where the next program goes, only the loader thread uses it
+   uint32_t next_start;
+   // Only the instruction store uses it
+   uint32_t num_pending;
+} program_loader;
+
+static program_loader loader;
+
+static void find_main(load_request* request)
+{
+   char* main_arg_name = "_main_arg_0_export";
+   char* main_return_location_name = "_main_return_location_export";
+   request->main_arg = NULL;
+   request->main_return_location = NULL;
+
+   // Only this module's exports, the names are in every program
+   export_node* cur = request->code.exports;
+   for (int i = 0; i < request->code.num_exports; i++)
+   {
+	  if (strcmp(cur->name, main_arg_name) == 0)
+	  {
+		 request->main_arg = cur;
+	  }
+	  if (strcmp(cur->name, main_return_location_name) == 0)
+	  {
+		 request->main_return_location = cur;
+	  }
+	  cur = cur->next;
+   }
+}
+
+static void* run_program_loader(void* arg)
+{
+   // SIGUSR1 has to wake up the instruction store thread
+   sigset_t signals;
+   sigemptyset(&signals);
+   sigaddset(&signals, SIGUSR1);
+   pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+   while (1)
+   {
+	  load_request* request;
+	  queue_remove(loader.requests, &request, sizeof(load_request*));
+
+	  request->code = link_cached_file(request->fd, &request->key, loader.next_start, false);
+	  close(request->fd);
+	  if (request->code.error != -1)
+	  {
+		 loader.next_start += request->code.current_num_instructions;
+		 find_main(request);
+	  }
+
+	  queue_add(loader.loaded, &request, sizeof(load_request*));
+	  ready_token_pair_type wake_up = {
+		 .token_1 = {.destination = PROGRAM_LOADED_DESTINATION},
+		 .token_2 = {.destination = PROGRAM_LOADED_DESTINATION},
+	  };
+	  queue_add(loader.ready_token_pair_queue, &wake_up, sizeof(ready_token_pair_type));
+   }
+   return NULL;
+}
+
+// Anything can send a token to PROGRAM_LOADED_DESTINATION, so this
+// only takes what the loader has finished
+static void add_loaded_programs(executable_packet_batches* executable_packets)
+{
+   while (!queue_is_empty(loader.loaded))
+   {
+	  load_request* request;
+	  queue_remove(loader.loaded, &request, sizeof(load_request*));
+	  loader.num_pending--;
+
+	  if (request->code.error == -1)
+	  {
+		 #ifdef DEBUG
+		 fprintf(stderr, "load_file returned error\n");
+		 #endif
+		 load_failed(request->address, request->tag, executable_packets);
+	  }
+	  else
+	  {
+		 // Nothing can reach the new instructions before they are added
+		 add_instructions(&request->code);
+
+		 module* mod = (module*)malloc(sizeof(module));
+		 mod->key = request->key;
+		 mod->start = request->code.start;
+		 mod->num_instructions = request->code.current_num_instructions;
+		 mod->main_arg = request->main_arg;
+		 mod->main_return_location = request->main_return_location;
+		 mod->running = false;
+		 mod->next = modules;
+		 modules = mod;
+		 run_module(mod, request->address, request->tag, request->arg, executable_packets);
+	  }
+	  free(request);
+	  checkpoint_finished_work(1);
+   }
+}
+
+static void execute_ready_token_pair(ready_token_pair_type next, executable_packet_batches* executable_packets)
+{
+   uint32_t address = DESTINATION_TO_ADDRESS(next.token_1.destination);
+
+   if (next.token_1.destination == PROGRAM_LOADED_DESTINATION)
+   {
+	  add_loaded_programs(executable_packets);
+	  return;
+   }
+
+   if (next.token_1.destination == MODULE_RETURN_DESTINATION)
+   {
+	  module_returned(next.token_1, executable_packets);
+	  return;
+   }
+
+   if (address >= num_instructions)
+   {
+	  #ifdef DEBUG
+	  fprintf(stderr, "ERROR, destination address %d is out of bounds on the number of instructions %d. Ignoring", address, num_instructions);
+	  print_token(next.token_1);
+	  print_token(next.token_2);
+	  #endif
+	  return;
+   }
+
+   instruction inst = instructions[address];
+   uint8_t num_inputs = opcode_to_num_inputs[inst.opcode];
+
+   if (inst.opcode == LOD)
+   {
+	  // We need to load some code! We handle this instruction.
+
+	  char* filename = (char*)&next.token_1.data;
+	  filename[7] = '\0';
+	  data_type arg = next.token_2.data;
+
+	  int fd = open(filename, O_RDONLY);
+	  if (fd == -1)
+	  {
+		 #ifdef DEBUG
+		 perror("open failed");
+		 #endif
+		 load_failed(address, next.token_1.tag, executable_packets);
+		 return;
+	  }
+
+	  file_key key;
+	  if (!get_file_key(fd, &key) || loader.num_pending == MAX_PENDING_LOADS)
+	  {
+		 #ifdef DEBUG
+		 fprintf(stderr, "Can't load %s\n", filename);
+		 #endif
+		 close(fd);
+		 load_failed(address, next.token_1.tag, executable_packets);
+		 return;
+	  }
+
+	  module* idle = find_idle_module(&key);
+	  if (idle != NULL)
+	  {
+		 #ifdef DEBUG
+		 fprintf(stderr, "Reusing the module at %u\n", idle->start);
+		 #endif
+		 close(fd);
+		 run_module(idle, address, next.token_1.tag, arg, executable_packets);
+		 return;
+	  }
+
+	  #ifdef DEBUG
+	  fprintf(stderr, "Loading %s\n", filename);
+	  #endif
+
+	  // The LOD is in progress until the loader hands it back
+	  load_request* request = (load_request*)malloc(sizeof(load_request));
+	  request->fd = fd;
+	  request->key = key;
+	  request->address = address;
+	  request->tag = next.token_1.tag;
+	  request->arg = arg;
+	  queue_add(loader.requests, &request, sizeof(load_request*));
+	  loader.num_pending++;
+	  checkpoint_took_work(1);
+	  return;
+   }
+	  
+   if (inst.instruction_literal == NONE && num_inputs == 2)
+   {
+	  #ifdef DEBUG
+	  if (DESTINATION_TO_ADDRESS(next.token_1.destination) != DESTINATION_TO_ADDRESS(next.token_2.destination))
+	  {
+		 printf("oops %d\n", address);
+		 print_instruction(inst);
+		 print_token(next.token_1);
+		 print_token(next.token_2);
+	  }
+	  assert(DESTINATION_TO_ADDRESS(next.token_1.destination) == DESTINATION_TO_ADDRESS(next.token_2.destination));
+	  assert(DESTINATION_TO_INPUT(next.token_1.destination) == INPUT_ONE);
+	  assert(DESTINATION_TO_INPUT(next.token_2.destination) == INPUT_TWO);
+	  assert(next.token_1.tag == next.token_2.tag);
+	  #endif
+		 
+	  execution_packet ready = {
+		 .data_1 = next.token_1.data,
+		 .data_2 = next.token_2.data,
+		 .opcode = inst.opcode,
+		 .tag = next.token_1.tag,
+		 .destination_1 = inst.destination_1,
+		 .destination_2 = inst.destination_2,
+		 .input = CREATE_DESTINATION(address, 0, 0),
+		 .marker = inst.marker,
+	  };
+	  add_executable_packet(executable_packets, &ready);
+   }
+   else if (inst.instruction_literal == ONE || num_inputs == 1)
+   {
+	  execution_packet ready = {
+		 .data_1 = next.token_1.data,
+		 .data_2 = inst.literal_1,
+		 .opcode = inst.opcode,
+		 .tag = next.token_1.tag,
+		 .destination_1 = inst.destination_1,
+		 .destination_2 = inst.destination_2,
+		 .input = CREATE_DESTINATION(address, 0, 0),
+		 .marker = inst.marker,
+	  };
+	  add_executable_packet(executable_packets, &ready);
+   }
+   else
+   {
+	  // should never get here, because instructions that have two
+	  // literal inputs are already sent to be executed when
+	  // instructions are added.
+	  #ifdef DEBUG
+	  assert(false);
+	  #endif 
+   }
+	  
+}
+
+bool load_initial_program(char* os_filename)
 {
    #ifdef DEBUG
    fprintf(stderr, "sephi_header: %ld\n", sizeof(sephi_header));
@@ -386,7 +1035,7 @@ void run_instruction_store(char* os_filename, queue* ready_token_pair_queue, que
 	  #ifdef DEBUG
 	  perror("open failed");
 	  #endif
-	  return;
+	  return false;
    }
    off_t file_size = lseek(fd, 0, SEEK_END);
    lseek(fd, 0, SEEK_SET);
@@ -402,193 +1051,114 @@ void run_instruction_store(char* os_filename, queue* ready_token_pair_queue, que
       #ifdef DEBUG
 	  fprintf(stderr, "load_file returned error\n");
       #endif
-	  exit(-1);
+	  return false;
    }
-   
-   // when we start up, go through all the initial instructions and
-   // make any that have two literal instructions (or one for monadic
-   // functions) ready.
-   add_ready_instructions(instructions, num_instructions, executable_packet_queue);
-
-   // now get ready token pairs and do stuff
-   while (1)
-   {
-	  ready_token_pair_type next;
-	  queue_remove(ready_token_pair_queue, &next, sizeof(ready_token_pair_type));
-
-	  uint32_t address = DESTINATION_TO_ADDRESS(next.token_1.destination);
+   return true;
+}
 
-	  if (address >= num_instructions)
-	  {
-		 #ifdef DEBUG
-		 fprintf(stderr, "ERROR, destination address %d is out of bounds on the number of instructions %d. Ignoring", address, num_instructions);
-		 print_token(next.token_1);
-		 print_token(next.token_2);
-		 #endif
-		 continue;
-	  }
+// Called from the main loop while the machine is quiescent
+static void save_instruction_store(int fd)
+{
+   checkpoint_write_section(fd, SNAPSHOT_INSTRUCTIONS, sizeof(instruction), num_instructions);
+   checkpoint_write(fd, instructions, sizeof(instruction) * num_instructions);
 
-	  instruction inst = instructions[address];
-	  uint8_t num_inputs = opcode_to_num_inputs[inst.opcode];
+   uint64_t num_exports = 0;
+   for (export_node* cur = exports; cur != NULL; cur = cur->next)
+   {
+	  num_exports++;
+   }
+   checkpoint_write_section(fd, SNAPSHOT_EXPORTS, sizeof(snapshot_export), num_exports);
+   for (export_node* cur = exports; cur != NULL; cur = cur->next)
+   {
+	  snapshot_export export = {.destination = cur->current_destination};
+	  strcpy(export.name, cur->name);
+	  checkpoint_write(fd, &export, sizeof(snapshot_export));
+   }
 
-	  if (inst.opcode == LOD)
-	  {
-		 // We need to load some code! We handle this instruction.
+   uint64_t num_calls = 0;
+   for (running_module* cur = running_modules; cur != NULL; cur = cur->next)
+   {
+	  num_calls++;
+   }
+   checkpoint_write_section(fd, SNAPSHOT_MODULE_CALLS, sizeof(module_call), num_calls);
+   for (running_module* cur = running_modules; cur != NULL; cur = cur->next)
+   {
+	  checkpoint_write(fd, &cur->call, sizeof(module_call));
+   }
+}
 
-		 char* filename = (char*)&next.token_1.data;
-		 filename[7] = '\0';
-		 data_type arg = next.token_2.data;
+void restore_instruction_store(instruction* restored_instructions, uint32_t num_restored_instructions, snapshot_export* restored_exports, uint32_t num_restored_exports)
+{
+   instructions = restored_instructions;
+   num_instructions = num_restored_instructions;
 
-		 int fd = open(filename, O_RDONLY);
-		 if (fd == -1)
-		 {
-			#ifdef DEBUG
-			perror("open failed");
-			#endif
-			goto load_fail;
-		 }
-		 off_t file_size = lseek(fd, 0, SEEK_END);
-		 lseek(fd, 0, SEEK_SET);
+   for (uint32_t i = 0; i < num_restored_exports; i++)
+   {
+	  restored_exports[i].name[REFERENCE_MAX_SIZE-1] = '\0';
+	  add_export(restored_exports[i].destination, restored_exports[i].name);
+   }
+}
 
-		 #ifdef DEBUG
-		 fprintf(stderr, "%s instruction filesize %ld\n", filename, file_size);
-		 #endif
+void run_instruction_store(queue* ready_token_pair_queue, queue* input_module_queue, queue* processing_unit_queue, machine_snapshot* restored)
+{
+   ready_token_pair_type pairs[QUEUE_BURST_SIZE];
+   executable_packet_batches executable_packets;
+   queue_batch_init(&executable_packets.input_module, input_module_queue, QUEUE_BURST_SIZE, sizeof(execution_packet));
+   queue_batch_init(&executable_packets.processing_unit, processing_unit_queue, QUEUE_BURST_SIZE, sizeof(execution_packet));
 
-		 loaded_code_info result = load_file(fd, file_size, false);
-		 close(fd);
-		 if (result.error == -1)
-		 {
-			#ifdef DEBUG
-			fprintf(stderr, "load_file returned error\n");
-			#endif
+   if (checkpoint != NULL)
+   {
+	  checkpoint_on_request(ready_token_pair_queue, save_instruction_store);
+   }
 
-			goto load_fail;
-		 }
-		 {
-			// call the main function using the exports.
-			char* main_arg_name = "_main_arg_0_export";
-			char* main_return_location_name = "_main_return_location_export";
-			export_node* main_arg = NULL;
-			export_node* main_return_location = NULL;
-
-			export_node* cur = result.exports;
-			while(cur != NULL)
-			{
-			   if (strcmp(cur->name, main_arg_name) == 0)
-			   {
-				  main_arg = cur;
-			   }
-			   if (strcmp(cur->name, main_return_location_name) == 0)
-			   {
-				  main_return_location = cur;
-			   }
-			   cur = cur->next;
-			}
-
-			if (main_arg != NULL && main_return_location != NULL)
-			{
-			   // we good, let's add some fake packets to make it seem like we're calling this function
-			   execution_packet arg_packet = {
-				  .data_1 = arg,
-				  .data_2 = 0,
-				  .opcode = DUP,
-				  .tag = next.token_1.tag,
-				  .destination_1 = main_arg->current_destination,
-				  .destination_2 = DEV_NULL_DESTINATION,
-                  .input = CREATE_DESTINATION(address, 0, 0),
-				  .marker = ONE_OUTPUT_MARKER,
-			   };
-			   queue_add(executable_packet_queue, &arg_packet, sizeof(execution_packet));
-
-			   // now add the return value
-			   execution_packet return_loc = {
-				  .data_1 = inst.destination_1,
-				  .data_2 = 0,
-				  .opcode = DUP,
-				  .tag = next.token_1.tag,
-				  .destination_1 = main_return_location->current_destination,
-				  .destination_2 = DEV_NULL_DESTINATION,
-                  .input = CREATE_DESTINATION(address, 0, 0),
-				  .marker = ONE_OUTPUT_MARKER,
-			   };
-			   queue_add(executable_packet_queue, &return_loc, sizeof(execution_packet));
-			}
-
-			add_ready_instructions(result.instructions, result.current_num_instructions, executable_packet_queue);
-			continue;
-
-		   load_fail:
-			{
-			   // Change the packet so that the result of the load is a -1
-			   execution_packet error_packet = {
-				  .data_1 = -1,
-				  .data_2 = 0,
-				  .opcode = DUP,
-				  .tag = next.token_1.tag,
-				  .destination_1 = inst.destination_1,
-				  .destination_2 = inst.destination_2,
-                  .input = CREATE_DESTINATION(address, 0, 0),
-				  .marker = inst.marker,
-			   };
-			   queue_add(executable_packet_queue, &error_packet, sizeof(execution_packet));
-			   continue;
-			}
+   loader.requests = queue_new(MAX_PENDING_LOADS, sizeof(load_request*), QUEUE_SPSC);
+   loader.loaded = queue_new(MAX_PENDING_LOADS, sizeof(load_request*), QUEUE_SPSC);
+   loader.ready_token_pair_queue = ready_token_pair_queue;
+   loader.next_start = num_instructions;
+   pthread_t loader_thread;
+   if (pthread_create(&loader_thread, NULL, run_program_loader, NULL) != 0)
+   {
+	  #ifdef DEBUG
+	  perror("Error starting the program loader");
+	  #endif
+	  exit(-1);
+   }
 
-		 }
-		 continue;
-	  }
-	  
-	  if (inst.instruction_literal == NONE && num_inputs == 2)
+   if (restored == NULL)
+   {
+	  // when we start up, go through all the initial instructions and
+	  // make any that have two literal instructions (or one for monadic
+	  // functions) ready.
+	  add_ready_instructions(instructions, num_instructions, NO_TAG, &executable_packets);
+   }
+   else
+   {
+	  // The literals fired before the snapshot, only the I/O that was
+	  // waiting for stdin is left to do
+	  for (unsigned long i = 0; i < restored->num_pending_packets; i++)
 	  {
-		 #ifdef DEBUG
-         if (DESTINATION_TO_ADDRESS(next.token_1.destination) != DESTINATION_TO_ADDRESS(next.token_2.destination))
-         {
-            printf("oops %d\n", address);
-            print_instruction(inst);
-            print_token(next.token_1);
-            print_token(next.token_2);
-         }
-		 assert(DESTINATION_TO_ADDRESS(next.token_1.destination) == DESTINATION_TO_ADDRESS(next.token_2.destination));
-		 assert(DESTINATION_TO_INPUT(next.token_1.destination) == INPUT_ONE);
-		 assert(DESTINATION_TO_INPUT(next.token_2.destination) == INPUT_TWO);
-		 assert(next.token_1.tag == next.token_2.tag);
-		 #endif
-		 
-		 execution_packet ready = {
-			.data_1 = next.token_1.data,
-			.data_2 = next.token_2.data,
-			.opcode = inst.opcode,
-			.tag = next.token_1.tag,
-			.destination_1 = inst.destination_1,
-			.destination_2 = inst.destination_2,
-            .input = CREATE_DESTINATION(address, 0, 0),
-			.marker = inst.marker,
-		 };
-		 queue_add(executable_packet_queue, &ready, sizeof(execution_packet));
+		 add_executable_packet(&executable_packets, &restored->pending_packets[i]);
 	  }
-	  else if (inst.instruction_literal == ONE || num_inputs == 1)
+	  // Their modules aren't restored, so they are never run again
+	  for (unsigned long i = 0; i < restored->num_module_calls; i++)
 	  {
-		 execution_packet ready = {
-			.data_1 = next.token_1.data,
-			.data_2 = inst.literal_1,
-			.opcode = inst.opcode,
-			.tag = next.token_1.tag,
-			.destination_1 = inst.destination_1,
-			.destination_2 = inst.destination_2,
-            .input = CREATE_DESTINATION(address, 0, 0),
-			.marker = inst.marker,
-		 };
-		 queue_add(executable_packet_queue, &ready, sizeof(execution_packet));
+		 add_running_module(restored->module_calls[i], NULL);
 	  }
-	  else
+   }
+   flush_executable_packets(&executable_packets);
+
+   // now get ready token pairs and do stuff
+   while (1)
+   {
+	  checkpoint_save_if_requested();
+	  unsigned long num_pairs = queue_remove_many(ready_token_pair_queue, pairs, QUEUE_BURST_SIZE, sizeof(ready_token_pair_type));
+	  checkpoint_took_work(num_pairs);
+
+	  for (unsigned long i = 0; i < num_pairs; i++)
 	  {
-		 // should never get here, because instructions that have two
-		 // literal inputs are already sent to be executed when
-		 // instructions are added.
-		 #ifdef DEBUG
-		 assert(false);
-		 #endif 
+		 execute_ready_token_pair(pairs[i], &executable_packets);
 	  }
-	  
+	  flush_executable_packets(&executable_packets);
+	  checkpoint_finished_work(num_pairs);
    }
 }
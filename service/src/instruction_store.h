@@ -1,14 +1,13 @@
 #ifndef INSTRUCTION_STORE_H
 #define INSTRUCTION_STORE_H
 
+#include "checkpoint.h"
 #include "types.h"
 #include "queue.h"
 #include "sephi.h"
 
-#define FIRST_DESTINATION 1
-#define SECOND_DESTINATION 2
-#define FIRST_LITERAL 3
-#define SECOND_LITERAL 4
+// Parsed programs kept around for LOD
+#define PROGRAM_CACHE_SIZE 16
 
 typedef struct _current_export_node {
    destination_type current_destination;
@@ -18,11 +17,25 @@ typedef struct _current_export_node {
 
 typedef struct {
    instruction* instructions;
+   // Where instructions go in the instruction memory
+   uint32_t start;
    int current_num_instructions;
+   // This module's exports are the num_exports nodes from exports on
    export_node* exports;
+   int num_exports;
    int error;
 } loaded_code_info;
 
-void run_instruction_store(char* os_filename, queue* ready_token_pair_queue, queue* executable_packet_queue);
+// Load and relocate the OS before the machine starts, the instruction
+// store (forked later) runs whatever is loaded
+bool load_initial_program(char* os_filename);
+// Append a program to the instruction memory. load_cached_file keeps
+// the parsed program for the next load of the same file.
+loaded_code_info load_file(int fd, off_t file_size, bool is_privileged);
+loaded_code_info load_cached_file(int fd, bool is_privileged);
+// Or start from a snapshot's instructions and exports instead
+void restore_instruction_store(instruction* restored_instructions, uint32_t num_restored_instructions, snapshot_export* restored_exports, uint32_t num_restored_exports);
+// restored is NULL when booting the loaded OS
+void run_instruction_store(queue* ready_token_pair_queue, queue* input_module_queue, queue* processing_unit_queue, machine_snapshot* restored);
 
 #endif /* INSTRUCTION_STORE_H */
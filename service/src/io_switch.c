@@ -1,53 +1,177 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "checkpoint.h"
 #include "io_switch.h"
+#include "matching_unit.h"
 
-void run_io_switch(queue* execution_token_output_queue, queue* matching_unit_input_queue)
+static uint32_t num_matching_units;
+static uint64_t* tokens_sent;
+static matching_unit_counter* tokens_done;
+static queue* input_handler_queue;
+
+// True when every token sent to the matching units has come out the
+// other side, so a token that skips them cannot overtake anything
+static bool matching_units_caught_up()
+{
+   for (uint32_t i = 0; i < num_matching_units; i++)
+   {
+	  if (atomic_load_explicit(&tokens_done[i], memory_order_acquire) != tokens_sent[i])
+	  {
+		 return false;
+	  }
+   }
+   return true;
+}
+
+// OUTD/OUTS output is collected here and written out at the end of
+// each burst (or when it fills up), so a burst of output tokens costs
+// one write. It is written before the burst's tokens are passed on,
+// so nothing that depends on it can get ahead of it.
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+static size_t output_length = 0;
+
+static void flush_output()
+{
+   size_t written = 0;
+   while (written < output_length)
+   {
+	  ssize_t result = write(STDOUT_FILENO, output_buffer + written, output_length - written);
+	  if (result <= 0)
+	  {
+		 #ifdef DEBUG
+		 perror("io_switch output failed");
+		 #endif
+		 break;
+	  }
+	  written += result;
+   }
+   checkpoint_wrote_output(output_buffer, written);
+   output_length = 0;
+}
+
+static void output(char* data, size_t length)
+{
+   if (length > OUTPUT_BUFFER_SIZE - output_length)
+   {
+	  flush_output();
+   }
+   memcpy(output_buffer + output_length, data, length);
+   output_length += length;
+}
+
+// printf("%ld\n", data) without printf
+static void output_number(data_type data)
 {
-   token_type next_token;
+   char digits[24];
+   char* cur = digits + sizeof(digits);
+   int64_t number = (int64_t)data;
+   uint64_t magnitude = (number < 0) ? -(uint64_t)number : (uint64_t)number;
+
+   *(--cur) = '\n';
+   do
+   {
+	  *(--cur) = '0' + (magnitude % 10);
+	  magnitude /= 10;
+   } while (magnitude != 0);
+   if (number < 0)
+   {
+	  *(--cur) = '-';
+   }
+   output(cur, digits + sizeof(digits) - cur);
+}
+
+static void route_token(token_type next_token, queue_batch* matching_unit_inputs, queue_batch* ready_token_pairs)
+{
+   switch(next_token.destination)
+   {
+	  case OUTPUTD_DESTINATION:
+		 output_number(next_token.data);
+		 break;
+
+	  case OUTPUTS_DESTINATION:
+		 // vuln: could use this to leak out the next part of the token,
+		 // might be useful for exploitation.
+		 output((char*)&next_token.data, strlen((char*)&next_token.data));
+		 break;
+
+	  // The fds live in the input module, it runs the handlers
+	  case REGISTER_INPUT_HANDLER_DESTINATION:
+	  case DEREGISTER_INPUT_HANDLER_DESTINATION:
+		 #ifdef DEBUG
+		 fprintf(stderr, "Input handler request:\n");
+		 print_token(next_token);
+		 #endif
+		 queue_add(input_handler_queue, &next_token, sizeof(token_type));
+		 break;
+
+	  case DEV_NULL_DESTINATION:
+		 // Just consume the token, it's not meant for anywhere (/dev/null)
+		 #ifdef DEBUG
+		 fprintf(stderr, "Ignoring this token:\n");
+		 print_token(next_token);
+		 #endif
+		 break;
+
+	  default:
+		 // Tokens for instructions that only need one input have
+		 // nothing to wait for, so they skip the matching unit
+		 // unless there is still older traffic in it
+		 if (DESTINATION_TO_MATCHING_FUNCTION(next_token.destination) != MATCHING_BOTH && matching_units_caught_up())
+		 {
+			ready_token_pair_type ready_token_pair;
+			ready_token_pair.token_1 = next_token;
+			queue_batch_add(ready_token_pairs, &ready_token_pair, sizeof(ready_token_pair_type));
+		 }
+		 else
+		 {
+			uint32_t unit = 0;
+			if (num_matching_units != 1)
+			{
+			   unit = key_to_matching_unit(token_to_key(next_token), num_matching_units);
+			}
+			queue_batch_add(&matching_unit_inputs[unit], &next_token, sizeof(token_type));
+			tokens_sent[unit] += 1;
+		 }
+   }
+}
+
+void run_io_switch(queue* execution_token_output_queue, queue** matching_unit_input_queues, uint32_t matching_units, matching_unit_counter* matching_units_done, queue* ready_token_pair_queue, queue* input_handler_requests)
+{
+   token_type tokens[QUEUE_BURST_SIZE];
+   queue_batch ready_token_pairs;
+   queue_batch_init(&ready_token_pairs, ready_token_pair_queue, QUEUE_BURST_SIZE, sizeof(ready_token_pair_type));
+   queue_batch* matching_unit_inputs = (queue_batch*)malloc(sizeof(queue_batch) * matching_units);
+   for (uint32_t i = 0; i < matching_units; i++)
+   {
+	  queue_batch_init(&matching_unit_inputs[i], matching_unit_input_queues[i], QUEUE_BURST_SIZE, sizeof(token_type));
+   }
+   num_matching_units = matching_units;
+   tokens_sent = (uint64_t*)calloc(matching_units, sizeof(uint64_t));
+   tokens_done = matching_units_done;
+   input_handler_queue = input_handler_requests;
 
    while (1)
    {
-	  queue_remove(execution_token_output_queue, &next_token, sizeof(token_type));
+	  unsigned long num_tokens = queue_remove_many(execution_token_output_queue, tokens, QUEUE_BURST_SIZE, sizeof(token_type));
+	  checkpoint_took_work(num_tokens);
+
+	  for (unsigned long i = 0; i < num_tokens; i++)
+	  {
+		 route_token(tokens[i], matching_unit_inputs, &ready_token_pairs);
+	  }
+	  // Output first, nothing this burst's tokens lead to may overtake it
+	  flush_output();
 
-	  switch(next_token.destination)
+	  // Tokens that skipped the matching units are older than anything
+	  // sent to them in this burst
+	  queue_batch_flush(&ready_token_pairs);
+	  for (uint32_t i = 0; i < matching_units; i++)
 	  {
-		 case OUTPUTD_DESTINATION:
-			printf("%ld\n", next_token.data);
-			fflush(stdout);
-			break;
-
-		 case OUTPUTS_DESTINATION:
-			// vuln: could use this to leak out the next part of the token,
-			// might be useful for exploitation.
-			printf("%s", (char*)&next_token.data);
-			fflush(stdout);
-			break;
-
-		 case REGISTER_INPUT_HANDLER_DESTINATION:
-			#ifdef DEBUG
-			fprintf(stderr, "TODO: unimplemented register input handler");
-			print_token(next_token);
-			#endif
-			break;
-
-		 case DEREGISTER_INPUT_HANDLER_DESTINATION:
-			#ifdef DEBUG
-			fprintf(stderr, "TODO: unimplemented deregister input handler");
-			print_token(next_token);
-			#endif
-			break;
-
-		 case DEV_NULL_DESTINATION:
-			// Just consume the token, it's not meant for anywhere (/dev/null)
-			#ifdef DEBUG
-			fprintf(stderr, "Ignoring this token:\n");
-			print_token(next_token);
-			#endif
-			break;
-
-		 default:
-			queue_add(matching_unit_input_queue, &next_token, sizeof(token_type));
+		 queue_batch_flush(&matching_unit_inputs[i]);
 	  }
+	  checkpoint_finished_work(num_tokens);
    }
 }
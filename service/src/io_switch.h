@@ -3,7 +3,10 @@
 
 #include "types.h"
 #include "queue.h"
+#include "matching_unit.h"
 
-void run_io_switch(queue* execution_token_output_queue, queue* matching_unit_input_queue);
+#define OUTPUT_BUFFER_SIZE 4096
+
+void run_io_switch(queue* execution_token_output_queue, queue** matching_unit_input_queues, uint32_t num_matching_units, matching_unit_counter* matching_units_done, queue* ready_token_pair_queue, queue* input_handler_requests);
 
 #endif /* IO_SWITCH_H */
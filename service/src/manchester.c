@@ -1,13 +1,18 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "checkpoint.h"
 #include "input_module.h"
 #include "instruction_store.h"
 #include "io_switch.h"
@@ -18,6 +23,11 @@
 
 #define SIZE_MATCHING_STORE 2048
 #define MAX_QUEUE_SIZE 1024
+#define INPUT_MODULE_SHUTDOWN_MS 1000
+#define MAX_PENDING_CONNECTIONS 128
+// Polls (1ms apart) that nothing may happen in before a checkpoint
+#define QUIESCENT_POLLS 10
+#define BOOT_SNAPSHOT_TEMPLATE "/tmp/manchester_boot.XXXXXX"
 
 #ifdef DEBUG
 void print_token(token_type token)
@@ -46,96 +56,365 @@ void print_instruction(instruction inst)
 
 #endif
 
-void start_machine(char* os_filename, int timeout)
+// Create one of the queues between the units. shared is true when
+// more than one process produces or consumes on it.
+static queue* new_machine_queue(machine_config* config, unsigned int element_size, bool shared)
+{
+   int flags = config->queue_flags;
+   if (flags != QUEUE_LOCKED && shared)
+   {
+	  flags = QUEUE_MPMC;
+   }
+   queue* to_return = queue_new(MAX_QUEUE_SIZE, element_size, flags);
+   queue_set_wait_strategy(to_return, config->wait_strategy, config->spin_limit);
+   return to_return;
+}
+
+static bool is_quiescent(queue** machine_queues, uint32_t num_queues)
+{
+   if (atomic_load(&checkpoint->busy) != 0)
+   {
+	  return false;
+   }
+   for (uint32_t i = 0; i < num_queues; i++)
+   {
+	  if (!queue_is_empty(machine_queues[i]))
+	  {
+		 return false;
+	  }
+   }
+   return true;
+}
+
+// Wait until the machine has nothing left to do but wait for stdin
+// and write the snapshot. False if the machine stopped first.
+static bool take_checkpoint(queue** machine_queues, uint32_t num_queues, pid_t instruction_store, pid_t* matching_units, uint32_t num_matching_units)
+{
+   uint64_t last_work = atomic_load(&checkpoint->work);
+   int quiet_polls = 0;
+   while (quiet_polls < QUIESCENT_POLLS)
+   {
+	  if (waitpid(-1, NULL, WNOHANG) != 0)
+	  {
+		 return false;
+	  }
+	  usleep(1000);
+
+	  uint64_t work = atomic_load(&checkpoint->work);
+	  if (work == last_work && is_quiescent(machine_queues, num_queues))
+	  {
+		 quiet_polls++;
+	  }
+	  else
+	  {
+		 quiet_polls = 0;
+	  }
+	  last_work = work;
+   }
+
+   uint32_t seed = ((uint32_t)time(NULL) ^ (uint32_t)getpid()) | 1;
+   int fd = checkpoint->fd;
+   if (!checkpoint_write_header(fd, seed) || !checkpoint_request(instruction_store))
+   {
+	  return false;
+   }
+   for (uint32_t i = 0; i < num_matching_units; i++)
+   {
+	  if (!checkpoint_request(matching_units[i]))
+	  {
+		 return false;
+	  }
+   }
+   save_trapped_tokens(fd);
+
+   uint32_t num_pending = atomic_load(&checkpoint->num_pending_packets);
+   return checkpoint_write_section(fd, SNAPSHOT_PENDING_PACKETS, sizeof(execution_packet), num_pending) &&
+	  checkpoint_write(fd, checkpoint->pending_packets, sizeof(execution_packet) * num_pending) &&
+	  checkpoint_write_output(fd);
+}
+
+// The restored tokens that belong to unit, they have to go back to the
+// matching unit their key maps to now
+static unsigned long restored_waiting_tokens(machine_snapshot* restored, uint32_t unit, uint32_t num_units, token_type** tokens)
+{
+   unsigned long num_tokens = 0;
+   *tokens = NULL;
+   if (restored == NULL)
+   {
+	  return 0;
+   }
+   *tokens = (token_type*)malloc(sizeof(token_type) * (restored->num_waiting_tokens + 1));
+   for (unsigned long i = 0; i < restored->num_waiting_tokens; i++)
+   {
+	  if (key_to_matching_unit(token_to_key(restored->waiting_tokens[i]), num_units) == unit)
+	  {
+		 (*tokens)[num_tokens++] = restored->waiting_tokens[i];
+	  }
+   }
+   return num_tokens;
+}
+
+bool start_machine(machine_config* config)
 {
    queue* execution_token_output_queue;
-   queue* matching_unit_input_queue;
+   queue** matching_unit_input_queues;
    queue* ready_token_pair_queue;
    queue* preprocessed_executable_packet_queue;
    queue* processed_executable_packet_queue;
+   queue* input_handler_queue;
 
-   #ifdef DEBUG
-   char* execution_token_output_queue_name = "/manchester-token-output";
-   #else
-   char* execution_token_output_queue_name = "/1";
-   #endif
-
-   #ifdef DEBUG
-   char* matching_unit_input_queue_name = "/manchester-token-input";
-   #else
-   char* matching_unit_input_queue_name = "/2";
-   #endif
-
-   #ifdef DEBUG
-   char* ready_token_pair_queue_name = "/manchester-ready-token-pair";
-   #else
-   char* ready_token_pair_queue_name = "/3";
-   #endif
+   // The input module pushes input handler tokens here as well
+   execution_token_output_queue = new_machine_queue(config, sizeof(token_type), true);
+   // Each matching unit gets its own input queue, the io switch picks one per token
+   matching_unit_input_queues = (queue**)malloc(sizeof(queue*) * config->num_matching_units);
+   for (uint32_t i = 0; i < config->num_matching_units; i++)
+   {
+	  matching_unit_input_queues[i] = new_machine_queue(config, sizeof(token_type), false);
+   }
+   matching_unit_counter* matching_units_done = new_matching_unit_counters(config->num_matching_units);
+   matching_unit_counter* matching_units_spilled = new_matching_unit_counters(config->num_matching_units);
+   matching_unit_counter* matching_units_restored = new_matching_unit_counters(config->num_matching_units);
+   // The io switch also writes here, for tokens that skip the matching units
+   ready_token_pair_queue = new_machine_queue(config, sizeof(ready_token_pair_type), true);
+   preprocessed_executable_packet_queue = new_machine_queue(config, sizeof(execution_packet), false);
+   // The instruction store sends everything but I/O packets here directly
+   processed_executable_packet_queue = new_machine_queue(config, sizeof(execution_packet), true);
+   input_handler_queue = new_machine_queue(config, sizeof(token_type), false);
+
+   init_processing_units(config->num_processing_units, config->restored ? config->restored->seed : 0);
+   if (config->restored != NULL)
+   {
+	  restore_trapped_tokens(config->restored->trapped_tokens, config->restored->num_trapped_tokens);
+   }
 
-   #ifdef DEBUG
-   char* preprocessed_executable_packet_queue_name = "/manchester-pexecutable-packet";
-   #else
-   char* preprocessed_executable_packet_queue_name = "/4";
-   #endif
+   if (config->checkpoint_path != NULL && !checkpoint_init(config->checkpoint_path))
+   {
+	  fprintf(stderr, "Error, can't write a snapshot to %s.\n", config->checkpoint_path);
+	  return false;
+   }
 
-   #ifdef DEBUG
-   char* processed_executable_packet_queue_name = "/manchester-executable-packets";
-   #else
-   char* processed_executable_packet_queue_name = "/5";
-   #endif
-   
-   execution_token_output_queue = queue_new(execution_token_output_queue_name, MAX_QUEUE_SIZE, sizeof(token_type));
-   matching_unit_input_queue = queue_new(matching_unit_input_queue_name, MAX_QUEUE_SIZE, sizeof(token_type));
-   ready_token_pair_queue = queue_new(ready_token_pair_queue_name, MAX_QUEUE_SIZE, sizeof(ready_token_pair_type));
-   preprocessed_executable_packet_queue = queue_new(preprocessed_executable_packet_queue_name, MAX_QUEUE_SIZE, sizeof(execution_packet));
-   processed_executable_packet_queue = queue_new(processed_executable_packet_queue_name, MAX_QUEUE_SIZE, sizeof(execution_packet));
+   // The restored session looks the same as the one that was saved,
+   // prompt included
+   if (config->restored != NULL && config->restored->output_length != 0)
+   {
+	  checkpoint_write(STDOUT_FILENO, config->restored->output, config->restored->output_length);
+	  checkpoint_wrote_output(config->restored->output, config->restored->output_length);
+   }
 
    pid_t instruction_store = fork();
    if (instruction_store == 0)
    {
-	  run_instruction_store(os_filename, ready_token_pair_queue, preprocessed_executable_packet_queue);
+	  run_instruction_store(ready_token_pair_queue, preprocessed_executable_packet_queue, processed_executable_packet_queue, config->restored);
    }
 
    pid_t input_module = fork();
    if (input_module == 0)
    {
-	  run_input_module(preprocessed_executable_packet_queue, processed_executable_packet_queue);
+	  run_input_module(preprocessed_executable_packet_queue, processed_executable_packet_queue, input_handler_queue, execution_token_output_queue);
    }
 
-   pid_t processing_unit = fork();
-   if (processing_unit == 0)
+   pid_t* processing_units = (pid_t*)malloc(sizeof(pid_t) * config->num_processing_units);
+   for (uint32_t i = 0; i < config->num_processing_units; i++)
    {
-	  run_processing_unit(processed_executable_packet_queue, execution_token_output_queue);
+	  processing_units[i] = fork();
+	  if (processing_units[i] == 0)
+	  {
+		 run_processing_unit(processed_executable_packet_queue, execution_token_output_queue, i);
+	  }
    }
 
    pid_t io_switch = fork();
    if (io_switch == 0)
    {
-	  run_io_switch(execution_token_output_queue, matching_unit_input_queue);
+	  run_io_switch(execution_token_output_queue, matching_unit_input_queues, config->num_matching_units, matching_units_done, ready_token_pair_queue, input_handler_queue);
    }
 
-   pid_t matching_unit = fork();
-   if (matching_unit == 0)
+   pid_t* matching_units = (pid_t*)malloc(sizeof(pid_t) * config->num_matching_units);
+   for (uint32_t i = 0; i < config->num_matching_units; i++)
    {
-	  run_matching_unit(matching_unit_input_queue, ready_token_pair_queue, SIZE_MATCHING_STORE);
+	  matching_units[i] = fork();
+	  if (matching_units[i] == 0)
+	  {
+		 token_type* restored_tokens;
+		 unsigned long num_restored_tokens = restored_waiting_tokens(config->restored, i, config->num_matching_units, &restored_tokens);
+		 run_matching_unit(matching_unit_input_queues[i], ready_token_pair_queue, SIZE_MATCHING_STORE, config->max_waiting_tokens, config->overflow_directory, &matching_units_done[i], &matching_units_spilled[i], &matching_units_restored[i], restored_tokens, num_restored_tokens);
+	  }
    }
 
    pid_t timeout_process = fork();
    if (timeout_process == 0)
    {
-	  sleep(timeout);
+	  sleep(config->timeout);
 	  exit(0);
    }
 
-   // wait for any of the children to die.
-   wait(NULL);
+   bool checkpointed = true;
+   if (checkpoint != NULL)
+   {
+	  uint32_t num_queues = 0;
+	  queue** machine_queues = (queue**)malloc(sizeof(queue*) * (config->num_matching_units + 5));
+	  machine_queues[num_queues++] = execution_token_output_queue;
+	  machine_queues[num_queues++] = ready_token_pair_queue;
+	  machine_queues[num_queues++] = preprocessed_executable_packet_queue;
+	  machine_queues[num_queues++] = processed_executable_packet_queue;
+	  machine_queues[num_queues++] = input_handler_queue;
+	  for (uint32_t i = 0; i < config->num_matching_units; i++)
+	  {
+		 machine_queues[num_queues++] = matching_unit_input_queues[i];
+	  }
+	  checkpointed = take_checkpoint(machine_queues, num_queues, instruction_store, matching_units, config->num_matching_units);
+	  close(checkpoint->fd);
+	  if (!checkpointed)
+	  {
+		 fprintf(stderr, "Error, the machine stopped before it could be checkpointed.\n");
+		 unlink(config->checkpoint_path);
+	  }
+   }
+   else
+   {
+	  // wait for any of the children to die.
+	  wait(NULL);
+   }
 
-   kill(processing_unit, 9);
+   for (uint32_t i = 0; i < config->num_processing_units; i++)
+   {
+	  kill(processing_units[i], 9);
+   }
+   for (uint32_t i = 0; i < config->num_matching_units; i++)
+   {
+	  kill(matching_units[i], 9);
+   }
+   // How often the -b budget sent tokens to the overflow store
+   for (uint32_t i = 0; i < config->num_matching_units; i++)
+   {
+	  uint64_t spilled = atomic_load(&matching_units_spilled[i]);
+	  uint64_t restored = atomic_load(&matching_units_restored[i]);
+	  if (spilled != 0 || restored != 0)
+	  {
+		 fprintf(stderr, "Matching unit %u spilled %lu waiting tokens to the overflow store, %lu came back.\n", i, spilled, restored);
+	  }
+   }
    kill(instruction_store, 9);
-   kill(matching_unit, 9);
    kill(io_switch, 9);
-   kill(input_module, 9);
    kill(timeout_process, 9);
+
+   // The input module may still hold buffered writes, give it a
+   // chance to flush them before it goes too.
+   kill(input_module, SIGTERM);
+   for (int i = 0; i < INPUT_MODULE_SHUTDOWN_MS; i++)
+   {
+	  if (waitpid(input_module, NULL, WNOHANG) != 0)
+	  {
+		 break;
+	  }
+	  usleep(1000);
+   }
+   kill(input_module, 9);
+   return checkpointed;
+}
+
+// Run the machine once up to where it first waits for stdin and
+// load that as a snapshot. NULL if it never got there.
+static machine_snapshot* boot_machine(machine_config* config)
+{
+   char snapshot_path[] = BOOT_SNAPSHOT_TEMPLATE;
+   int fd = mkstemp(snapshot_path);
+   if (fd == -1)
+   {
+	  #ifdef DEBUG
+	  perror("Error creating the boot snapshot");
+	  #endif
+	  return NULL;
+   }
+   close(fd);
+
+   pid_t boot = fork();
+   if (boot == 0)
+   {
+	  // The boot output is kept in the snapshot, every connection
+	  // gets it when its machine is restored
+	  int null_fd = open("/dev/null", O_RDWR);
+	  dup2(null_fd, STDIN_FILENO);
+	  dup2(null_fd, STDOUT_FILENO);
+	  close(null_fd);
+	  machine_config boot_config = *config;
+	  boot_config.checkpoint_path = snapshot_path;
+	  exit(start_machine(&boot_config) ? 0 : -1);
+   }
+
+   machine_snapshot* booted = NULL;
+   int status;
+   if (boot != -1 && waitpid(boot, &status, 0) == boot && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+   {
+	  booted = load_snapshot(snapshot_path);
+   }
+   unlink(snapshot_path);
+   return booted;
+}
+
+// Fork server: the OS is booted once, up to its first prompt, and each
+// connection gets a machine restored from there, so it only costs the
+// machine's queues and unit forks. The connection becomes the
+// machine's stdin and stdout.
+void serve_machines(char* socket_path, machine_config* config)
+{
+   int server = socket(AF_UNIX, SOCK_STREAM, 0);
+   struct sockaddr_un address = {.sun_family = AF_UNIX};
+   if (server == -1 || strlen(socket_path) >= sizeof(address.sun_path))
+   {
+	  fprintf(stderr, "Error, can't serve on %s.\n", socket_path);
+	  exit(-1);
+   }
+   strcpy(address.sun_path, socket_path);
+   unlink(socket_path);
+   if (bind(server, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+	   listen(server, MAX_PENDING_CONNECTIONS) == -1)
+   {
+	  #ifdef DEBUG
+	  perror("Error listening");
+	  #endif
+	  fprintf(stderr, "Error, can't serve on %s.\n", socket_path);
+	  exit(-1);
+   }
+
+   if (config->restored == NULL)
+   {
+	  config->restored = boot_machine(config);
+	  #ifdef DEBUG
+	  if (config->restored == NULL)
+	  {
+		 fprintf(stderr, "The machine didn't wait for stdin, booting it for each connection\n");
+	  }
+	  #endif
+   }
+
+   // Finished machines are reaped by the kernel
+   signal(SIGCHLD, SIG_IGN);
+
+   while (1)
+   {
+	  int connection = accept(server, NULL, NULL);
+	  if (connection == -1)
+	  {
+		 #ifdef DEBUG
+		 perror("Error accepting");
+		 #endif
+		 continue;
+	  }
+
+	  if (fork() == 0)
+	  {
+		 // start_machine waits for its own units to die
+		 signal(SIGCHLD, SIG_DFL);
+		 close(server);
+		 dup2(connection, STDIN_FILENO);
+		 dup2(connection, STDOUT_FILENO);
+		 close(connection);
+		 start_machine(config);
+		 exit(0);
+	  }
+	  close(connection);
+   }
 }
 
 int main(int argc, char** argv)
@@ -165,9 +444,22 @@ int main(int argc, char** argv)
    #endif
    int opt;
    char* filename = NULL;
-   int timeout = 5;
-
-   while ((opt = getopt(argc, argv, "f:t:")) != -1)
+   char* socket_path = NULL;
+   machine_config config = {
+	  .timeout = 5,
+	  .queue_flags = QUEUE_SPSC,
+	  .wait_strategy = QUEUE_WAIT_ADAPTIVE,
+	  .spin_limit = QUEUE_DEFAULT_SPIN_LIMIT,
+	  .num_processing_units = 1,
+	  .num_matching_units = 1,
+	  .max_waiting_tokens = 0,
+	  .overflow_directory = "/tmp",
+	  .checkpoint_path = NULL,
+	  .restored = NULL,
+   };
+   char* snapshot_path = NULL;
+
+   while ((opt = getopt(argc, argv, "f:t:lw:s:p:m:b:o:z:c:r:")) != -1)
    {
 	  switch (opt) {
 		 case 'f':
@@ -175,23 +467,115 @@ int main(int argc, char** argv)
 			break;
 
 		 case 't':
-			timeout = atoi(optarg);
+			config.timeout = atoi(optarg);
+			break;
+
+		 case 'l':
+			config.queue_flags = QUEUE_LOCKED;
+			break;
+
+		 case 'w':
+			if (strcmp(optarg, "spin") == 0)
+			{
+			   config.wait_strategy = QUEUE_WAIT_SPIN;
+			}
+			else if (strcmp(optarg, "adaptive") == 0)
+			{
+			   config.wait_strategy = QUEUE_WAIT_ADAPTIVE;
+			}
+			else if (strcmp(optarg, "block") == 0)
+			{
+			   config.wait_strategy = QUEUE_WAIT_BLOCK;
+			}
+			else
+			{
+			   fprintf(stderr, "Error, wait strategy must be one of spin, adaptive or block.\n");
+			   exit(-1);
+			}
+			break;
+
+		 case 's':
+			config.spin_limit = strtoul(optarg, NULL, 10);
+			break;
+
+		 case 'p':
+			if (atoi(optarg) < 1)
+			{
+			   fprintf(stderr, "Error, need at least one processing unit.\n");
+			   exit(-1);
+			}
+			config.num_processing_units = atoi(optarg);
+			break;
+
+		 case 'm':
+			if (atoi(optarg) < 1)
+			{
+			   fprintf(stderr, "Error, need at least one matching unit.\n");
+			   exit(-1);
+			}
+			config.num_matching_units = atoi(optarg);
+			break;
+
+		 case 'b':
+			config.max_waiting_tokens = strtoul(optarg, NULL, 10);
+			break;
+
+		 case 'o':
+			config.overflow_directory = strdup(optarg);
+			break;
+
+		 case 'z':
+			socket_path = strdup(optarg);
+			break;
+
+		 case 'c':
+			config.checkpoint_path = strdup(optarg);
+			break;
+
+		 case 'r':
+			snapshot_path = strdup(optarg);
 			break;
 
 		 default:
-			fprintf(stderr, "Usage: %s [-f initial_program] [-t timeout]\n", argv[0]);
+			fprintf(stderr, "Usage: %s [-f initial_program] [-t timeout] [-l] [-w spin|adaptive|block] [-s spin_limit] [-p processing_units] [-m matching_units] [-b max_waiting_tokens] [-o overflow_directory] [-z socket_path] [-c snapshot] [-r snapshot]\n", argv[0]);
 			exit(-1);
 	  }
    }
 
-   if (filename == NULL)
+   if (filename == NULL && snapshot_path == NULL)
    {
 	  fprintf(stderr, "Error, must specify an initial filename.\n");
 	  exit(-1);
    }
 
-   start_machine(filename, timeout);
+   if (socket_path != NULL && config.checkpoint_path != NULL)
+   {
+	  fprintf(stderr, "Error, can't checkpoint in server mode.\n");
+	  exit(-1);
+   }
+
+   if (snapshot_path != NULL)
+   {
+	  config.restored = load_snapshot(snapshot_path);
+	  if (config.restored == NULL)
+	  {
+		 fprintf(stderr, "Error, %s is not a snapshot.\n", snapshot_path);
+		 exit(-1);
+	  }
+   }
+   else if (!load_initial_program(filename))
+   {
+	  exit(-1);
+   }
 
+   if (socket_path != NULL)
+   {
+	  serve_machines(socket_path, &config);
+   }
+   if (!start_machine(&config))
+   {
+	  return -1;
+   }
    return 0;
 }
 
@@ -1,5 +1,37 @@
 #ifndef MANCHESTER_H
 #define MANCHESTER_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "checkpoint.h"
+
+typedef struct {
+   int timeout;
+   // QUEUE_SPSC or QUEUE_LOCKED, queues that are shared by more than
+   // one producer or consumer use QUEUE_MPMC instead of QUEUE_SPSC
+   int queue_flags;
+   int wait_strategy;
+   unsigned long spin_limit;
+   uint32_t num_processing_units;
+   // Tokens for unrelated instructions can overtake each other when
+   // there is more than one matching unit, so independent outputs are
+   // no longer printed in a fixed order
+   uint32_t num_matching_units;
+   // Waiting tokens each matching unit keeps in memory before spilling
+   // the oldest to its overflow store, 0 for no limit
+   unsigned long max_waiting_tokens;
+   // Where the overflow stores keep the spilled tokens
+   char* overflow_directory;
+   // Write a snapshot here once the machine is quiescent, then stop
+   char* checkpoint_path;
+   // Start from this snapshot instead of booting the OS, or NULL
+   machine_snapshot* restored;
+} machine_config;
+
+// Both expect the OS (or a snapshot) to be loaded already. False if a
+// checkpoint was asked for and couldn't be taken.
+bool start_machine(machine_config* config);
+void serve_machines(char* socket_path, machine_config* config);
 
 #endif /* MANCHESTER_H */
@@ -1,12 +1,21 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 
+#include "checkpoint.h"
 #include "types.h"
 #include "matching_unit.h"
+#include "overflow_store.h"
 #include "queue.h"
 
 token_waiting_table_type* token_waiting_table;
+static overflow_store* overflow = NULL;
+// Tokens that went to the overflow store and came back from it
+static matching_unit_counter* spilled = NULL;
+static matching_unit_counter* restored = NULL;
+
+static void resize_waiting_table(unsigned long new_size);
 
 key_type token_to_key(token_type token)
 {
@@ -16,10 +25,22 @@ key_type token_to_key(token_type token)
    return to_return;
 }
 
-unsigned long key_to_index(key_type key)
+// Pick the matching unit that owns key. Both inputs of an instruction
+// share a key, so they always meet in the same unit.
+uint32_t key_to_matching_unit(key_type key, uint32_t num_matching_units)
+{
+   uint64_t hash = (key.tag ^ ((uint64_t)key.destination << 32)) * 0x9E3779B97F4A7C15ULL;
+   return (hash >> 32) % num_matching_units;
+}
+
+// Tag areas are random high bits and iteration counts are sequential,
+// so mix everything before taking the low bits (splitmix64 finalizer).
+static inline uint64_t key_to_hash(key_type key)
 {
-   uint64_t idx = key.tag + key.destination;
-   return idx % token_waiting_table->table_size;
+   uint64_t hash = key.tag ^ ((uint64_t)key.destination << 32);
+   hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+   return hash ^ (hash >> 31);
 }
 
 static inline bool key_equal(key_type key1, key_type key2)
@@ -50,148 +71,337 @@ ready_token_pair_type ready_token_pair_from_tokens(token_type token_1, token_typ
    return to_return;
 }
 
-void run_matching_unit(queue* incoming_token_queue, queue* ready_token_pair_queue, uint32_t max_table_size)
+static void match_token(token_type next_token, queue_batch* ready_token_pairs)
 {
-   token_waiting_table = (token_waiting_table_type*)malloc(sizeof(token_waiting_table_type));
-   token_waiting_table->num_elements = 0;
-   token_waiting_table->table_size = max_table_size;
+   ready_token_pair_type ready_token_pair;
 
-   token_waiting_table->table = (table_elements*)malloc(sizeof(table_elements) * token_waiting_table->table_size);
+   // fprintf(stderr, "Matching unit got a new token\n");
+   // print_token(next_token);
 
-   // Everything is empty
-   for (int i = 0; i < token_waiting_table->table_size; i++)
+   uint8_t matching_function = DESTINATION_TO_MATCHING_FUNCTION(next_token.destination);
+   // The instruction that this is destined for only needs one
+   // input (maybe it is a monadic operator or includes a literal), so it is sent to the output.
+   // MATCHING_ANY is used for MERGE instructions, so whatever is ready is sent to the output.
+   // The io switch only sends these here while we are behind, to keep them in order.
+   if (matching_function == MATCHING_ONE || matching_function == MATCHING_ANY)
    {
-	  token_waiting_table->table[i].element_type = EMPTY;
+	  ready_token_pair.token_1 = next_token;
+	  queue_batch_add(ready_token_pairs, &ready_token_pair, sizeof(ready_token_pair_type));		 
    }
+   else if (matching_function == MATCHING_BOTH)
+   {
+	  token_type found;
+	  // Is the other input in our waiting table? If so, send both to the output queue,
+	  // otherwise this token waits in the table for its partner.
+	  if (match_in_waiting_table(token_to_key(next_token), next_token, &found))
+	  {
+		 ready_token_pair = ready_token_pair_from_tokens(next_token, found);
+		 queue_batch_add(ready_token_pairs, &ready_token_pair, sizeof(ready_token_pair_type));
+	  }
+   }
+   else
+   {
+	  #ifdef DEBUG
+	  fprintf(stderr, "ERROR: unhandled matching function %d\n", matching_function);
+	  assert(false);
+	  #endif
+   }
+}
 
-   while (1)
+// One counter per matching unit of how many tokens it has taken in
+// and flushed to the ready token pair queue, shared with the io switch
+matching_unit_counter* new_matching_unit_counters(uint32_t num_units)
+{
+   matching_unit_counter* to_return = (matching_unit_counter*) mmap(NULL, sizeof(matching_unit_counter) * num_units, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (to_return == MAP_FAILED)
    {
-	  token_type next_token;
-	  ready_token_pair_type ready_token_pair;
-	  queue_remove(incoming_token_queue, &next_token, sizeof(token_type));
+	  #ifdef DEBUG
+	  perror("mmap fail");
+	  #endif
+	  exit(-1);
+   }
+   for (uint32_t i = 0; i < num_units; i++)
+   {
+	  atomic_init(&to_return[i], 0);
+   }
+   return to_return;
+}
 
-	  // fprintf(stderr, "Matching unit got a new token\n");
-	  // print_token(next_token);
+static void save_waiting_token(token_type token, void* arg)
+{
+   checkpoint_write(*(int*)arg, &token, sizeof(token_type));
+}
 
-	  uint8_t matching_function = DESTINATION_TO_MATCHING_FUNCTION(next_token.destination);
-	  // The instruction that this is destined for only needs one
-	  // input (maybe it is a monadic operator or includes a literal), so it is sent to the output.
-	  // MATCHING_ANY is used for MERGE instructions, so whatever is ready is sent to the output
-	  if (matching_function == MATCHING_ONE || matching_function == MATCHING_ANY)
+// Called from the main loop while the machine is quiescent
+static void save_waiting_tokens(int fd)
+{
+   uint64_t num_tokens = token_waiting_table->num_elements;
+   if (overflow != NULL)
+   {
+	  num_tokens += overflow_store_size(overflow);
+   }
+   checkpoint_write_section(fd, SNAPSHOT_WAITING_TOKENS, sizeof(token_type), num_tokens);
+   for (unsigned long i = 0; i < token_waiting_table->table_size; i++)
+   {
+	  if (token_waiting_table->probe_lengths[i] != 0)
 	  {
-		 ready_token_pair.token_1 = next_token;
-		 queue_add(ready_token_pair_queue, &ready_token_pair, sizeof(ready_token_pair_type));		 
+		 save_waiting_token(token_waiting_table->entries[i].value, &fd);
 	  }
-	  else if (matching_function == MATCHING_BOTH)
-	  {
-		 key_type key = token_to_key(next_token);
+   }
+   if (overflow != NULL)
+   {
+	  overflow_store_for_each(overflow, save_waiting_token, &fd);
+   }
+}
 
-		 // Is the other input in our waiting table? If so, send it to the output queue (and remove the other)
-		 // if the other input is not in our waiting table, then insert this token into
-		 unsigned long element_index = key_to_index(key);
+void run_matching_unit(queue* incoming_token_queue, queue* ready_token_pair_queue, uint32_t initial_table_size, unsigned long max_waiting_tokens, char* overflow_directory, matching_unit_counter* tokens_done, matching_unit_counter* tokens_spilled, matching_unit_counter* tokens_restored, token_type* restored_tokens, unsigned long num_restored_tokens)
+{
+   spilled = tokens_spilled;
+   restored = tokens_restored;
+   token_waiting_table = (token_waiting_table_type*)calloc(1, sizeof(token_waiting_table_type));
 
-		 table_elements element = token_waiting_table->table[element_index];
-		 if (element.element_type == EMPTY)
-		 {
-			add_to_waiting_table(key, next_token);
-		 }
-		 else
-		 {
-			token_type* found = NULL;
-			for (table_list_type* cur = element.element; cur != NULL; cur = cur->next)
-			{
-			   if (key_equal(key, cur->key))
-			   {
-				  found = &(cur->value);
-				  break;
-			   }			   
-			}
-			if (found == NULL)
-			{
-			   add_to_waiting_table(key, next_token);
-			}
-			else
-			{
-			   ready_token_pair = ready_token_pair_from_tokens(next_token, *found);
-			   queue_add(ready_token_pair_queue, &ready_token_pair, sizeof(ready_token_pair_type));
-			   remove_from_waiting_table(key);
-			}
-		 }
-	  }
-	  else
+   // Without a budget the table just keeps growing
+   if (max_waiting_tokens != 0)
+   {
+	  token_waiting_table->max_elements = max_waiting_tokens;
+	  token_waiting_table->insertion_capacity = 1024;
+	  token_waiting_table->insertion_order = (key_type*)malloc(sizeof(key_type) * token_waiting_table->insertion_capacity);
+	  overflow = overflow_store_new(overflow_directory);
+   }
+
+   unsigned long table_size = 16;
+   while (table_size < initial_table_size)
+   {
+	  table_size <<= 1;
+   }
+   resize_waiting_table(table_size);
+
+   // Tokens from a snapshot were waiting for partners that haven't
+   // come yet, so none of them match here
+   token_type partner;
+   for (unsigned long i = 0; i < num_restored_tokens; i++)
+   {
+	  match_in_waiting_table(token_to_key(restored_tokens[i]), restored_tokens[i], &partner);
+   }
+
+   if (checkpoint != NULL)
+   {
+	  checkpoint_on_request(incoming_token_queue, save_waiting_tokens);
+   }
+
+   token_type tokens[QUEUE_BURST_SIZE];
+   queue_batch ready_token_pairs;
+   queue_batch_init(&ready_token_pairs, ready_token_pair_queue, QUEUE_BURST_SIZE, sizeof(ready_token_pair_type));
+
+   while (1)
+   {
+	  checkpoint_save_if_requested();
+	  unsigned long num_tokens = queue_remove_many(incoming_token_queue, tokens, QUEUE_BURST_SIZE, sizeof(token_type));
+	  checkpoint_took_work(num_tokens);
+
+	  for (unsigned long i = 0; i < num_tokens; i++)
 	  {
-		 #ifdef DEBUG
-		 fprintf(stderr, "ERROR: unhandled matching function %d\n", matching_function);
-		 assert(false);
-		 #endif
+		 match_token(tokens[i], &ready_token_pairs);
 	  }
+	  queue_batch_flush(&ready_token_pairs);
+	  atomic_fetch_add_explicit(tokens_done, num_tokens, memory_order_release);
+	  checkpoint_finished_work(num_tokens);
    }
 }
 
-void add_to_waiting_table(key_type key, token_type token)
+// Find where key is (true) or where it would be inserted (false)
+static bool probe_waiting_table(key_type key, unsigned long* index, uint32_t* probe_length)
 {
-   unsigned long element_index = key_to_index(key);
-   table_elements* element = &token_waiting_table->table[element_index];
-   table_list_type* next = NULL;
-   
-   if (element->element_type == EMPTY)
+   uint32_t* probe_lengths = token_waiting_table->probe_lengths;
+   unsigned long mask = token_waiting_table->mask;
+   *index = key_to_hash(key) & mask;
+   *probe_length = 1;
+
+   // Robin Hood invariant: once we reach a slot that is closer to its
+   // home than we are to ours, the key is not in the table.
+   while (probe_lengths[*index] >= *probe_length)
    {
-	  element->element_type = LIST;
+	  if (probe_lengths[*index] == *probe_length && key_equal(token_waiting_table->entries[*index].key, key))
+	  {
+		 return true;
+	  }
+	  *index = (*index + 1) & mask;
+	  *probe_length += 1;
    }
-   else
+   return false;
+}
+
+// Insert where the probe stopped and push the richer entries further along
+static void insert_into_waiting_table(unsigned long index, uint32_t probe_length, table_entry to_insert)
+{
+   uint32_t* probe_lengths = token_waiting_table->probe_lengths;
+   table_entry* entries = token_waiting_table->entries;
+   unsigned long mask = token_waiting_table->mask;
+
+   while (probe_lengths[index] != 0)
    {
-	  next = element->element;
+	  if (probe_lengths[index] < probe_length)
+	  {
+		 table_entry displaced = entries[index];
+		 uint32_t displaced_length = probe_lengths[index];
+		 entries[index] = to_insert;
+		 probe_lengths[index] = probe_length;
+		 to_insert = displaced;
+		 probe_length = displaced_length;
+	  }
+	  index = (index + 1) & mask;
+	  probe_length += 1;
    }
+   entries[index] = to_insert;
+   probe_lengths[index] = probe_length;
+   token_waiting_table->num_elements += 1;
+}
 
-   element->element = (table_list_type*) malloc(sizeof(table_list_type));
-   element->element->key = key;
-   element->element->value = token;
-   element->element->next = next;
+// Backward shift deletion, no tombstones
+static void remove_from_waiting_table(unsigned long index)
+{
+   uint32_t* probe_lengths = token_waiting_table->probe_lengths;
+   table_entry* entries = token_waiting_table->entries;
+   unsigned long mask = token_waiting_table->mask;
+
+   unsigned long next = (index + 1) & mask;
+   while (probe_lengths[next] > 1)
+   {
+	  entries[index] = entries[next];
+	  probe_lengths[index] = probe_lengths[next] - 1;
+	  index = next;
+	  next = (next + 1) & mask;
+   }
+   probe_lengths[index] = 0;
+   token_waiting_table->num_elements -= 1;
 }
 
-/* Required that key exists in the waiting table */
-void remove_from_waiting_table(key_type key)
+static void resize_waiting_table(unsigned long new_size)
 {
-   unsigned long element_index = key_to_index(key);
-   table_elements* element = &token_waiting_table->table[element_index];
+   uint32_t* old_probe_lengths = token_waiting_table->probe_lengths;
+   table_entry* old_entries = token_waiting_table->entries;
+   unsigned long old_size = token_waiting_table->table_size;
 
-   #ifdef DEBUG
-   assert(element->element_type == LIST);
-   #endif
+   token_waiting_table->table_size = new_size;
+   token_waiting_table->mask = new_size - 1;
+   token_waiting_table->num_elements = 0;
+   token_waiting_table->probe_lengths = (uint32_t*)calloc(new_size, sizeof(uint32_t));
+   token_waiting_table->entries = (table_entry*)malloc(sizeof(table_entry) * new_size);
+   if (token_waiting_table->probe_lengths == NULL || token_waiting_table->entries == NULL)
+   {
+	  #ifdef DEBUG
+	  perror("Error growing the token waiting table");
+	  #endif
+	  exit(-1);
+   }
 
+   for (unsigned long i = 0; i < old_size; i++)
+   {
+	  if (old_probe_lengths[i] != 0)
+	  {
+		 unsigned long index;
+		 uint32_t probe_length;
+		 probe_waiting_table(old_entries[i].key, &index, &probe_length);
+		 insert_into_waiting_table(index, probe_length, old_entries[i]);
+	  }
+   }
+   free(old_probe_lengths);
+   free(old_entries);
+}
 
-   if (key_equal(element->element->key, key))
+static void remember_insertion(key_type key)
+{
+   if (token_waiting_table->insertion_end == token_waiting_table->insertion_capacity)
    {
-	  if (element->element->next == NULL)
+	  // Drop the keys that have been matched since, they would
+	  // otherwise pile up while the table stays under budget
+	  unsigned long kept = 0;
+	  for (unsigned long i = token_waiting_table->insertion_start; i < token_waiting_table->insertion_end; i++)
 	  {
-		 element->element_type = EMPTY;
-		 free(element->element);
+		 unsigned long index;
+		 uint32_t probe_length;
+		 if (probe_waiting_table(token_waiting_table->insertion_order[i], &index, &probe_length))
+		 {
+			token_waiting_table->insertion_order[kept] = token_waiting_table->insertion_order[i];
+			kept += 1;
+		 }
 	  }
-	  else
+	  token_waiting_table->insertion_start = 0;
+	  token_waiting_table->insertion_end = kept;
+
+	  if (kept * 2 > token_waiting_table->insertion_capacity)
 	  {
-		 table_list_type* to_free = element->element;
-		 
-		 element->element = element->element->next;
-		 free(to_free);
+		 token_waiting_table->insertion_capacity *= 2;
+		 token_waiting_table->insertion_order = (key_type*)realloc(token_waiting_table->insertion_order, sizeof(key_type) * token_waiting_table->insertion_capacity);
+		 if (token_waiting_table->insertion_order == NULL)
+		 {
+			#ifdef DEBUG
+			perror("Error growing the insertion order");
+			#endif
+			exit(-1);
+		 }
 	  }
    }
-   else
+   token_waiting_table->insertion_order[token_waiting_table->insertion_end] = key;
+   token_waiting_table->insertion_end += 1;
+}
+
+// Move the least recently inserted tokens to the overflow store until
+// the table is back under budget
+static void spill_waiting_tokens()
+{
+   while (token_waiting_table->num_elements > token_waiting_table->max_elements &&
+		  token_waiting_table->insertion_start < token_waiting_table->insertion_end)
    {
-	  bool found = false;
-	  table_list_type* prev = element->element;
-	  for (table_list_type* cur = element->element->next; cur != NULL; cur = cur->next)
+	  key_type key = token_waiting_table->insertion_order[token_waiting_table->insertion_start];
+	  token_waiting_table->insertion_start += 1;
+
+	  unsigned long index;
+	  uint32_t probe_length;
+	  if (probe_waiting_table(key, &index, &probe_length))
 	  {
-		 if (key_equal(cur->key, key))
-		 {
-			prev->next = cur->next;
-			free(cur);
-			found = true;
-			break;
-		 }
-		 prev = cur;
+		 overflow_store_put(overflow, key, token_waiting_table->entries[index].value);
+		 remove_from_waiting_table(index);
+		 atomic_fetch_add_explicit(spilled, 1, memory_order_relaxed);
 	  }
-	  #ifdef DEBUG
-	  assert(found);
-	  #endif
    }
 }
+
+/*
+  One probe does both halves of matching: if the partner of key is
+  waiting it is removed and copied to partner, otherwise token is
+  inserted where the probe stopped. Tokens are only looked up in the
+  overflow store when they miss in the table.
+ */
+bool match_in_waiting_table(key_type key, token_type token, token_type* partner)
+{
+   if ((token_waiting_table->num_elements + 1) * 4 > token_waiting_table->table_size * 3)
+   {
+	  resize_waiting_table(token_waiting_table->table_size * 2);
+   }
+
+   unsigned long index;
+   uint32_t probe_length;
+   if (probe_waiting_table(key, &index, &probe_length))
+   {
+	  *partner = token_waiting_table->entries[index].value;
+	  remove_from_waiting_table(index);
+	  return true;
+   }
+
+   if (overflow != NULL && overflow_store_take(overflow, key, partner))
+   {
+	  atomic_fetch_add_explicit(restored, 1, memory_order_relaxed);
+	  return true;
+   }
+
+   table_entry to_insert = {.key = key, .value = token};
+   insert_into_waiting_table(index, probe_length, to_insert);
+
+   if (overflow != NULL)
+   {
+	  remember_insertion(key);
+	  spill_waiting_tokens();
+   }
+   return false;
+}
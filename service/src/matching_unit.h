@@ -1,6 +1,9 @@
 #ifndef MATCHING_UNIT_H
 #define MATCHING_UNIT_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+
 #include "types.h"
 #include "queue.h"
 
@@ -9,27 +12,40 @@ typedef struct {
    destination_type destination;
 } key_type;
 
-typedef struct _table_list {
+typedef struct {
    key_type key;
    token_type value;
-   struct _table_list* next;
-} table_list_type;
-
-typedef enum {EMPTY, LIST} table_element_type;
-
-typedef struct {
-   table_element_type element_type;
-   table_list_type* element;
-} table_elements;
+} table_entry;
 
+// Open addressing with Robin Hood probing. probe_lengths[i] is 0 when
+// slot i is empty, otherwise how far entries[i] sits from its home
+// slot plus one. table_size is always a power of two.
 typedef struct {
    unsigned long num_elements;
    unsigned long table_size;
-   table_elements* table;
+   unsigned long mask;
+   uint32_t* probe_lengths;
+   table_entry* entries;
+
+   // Only used with a budget: once there are more than max_elements
+   // waiting tokens, the oldest are spilled to the overflow store.
+   // insertion_order holds keys oldest first, keys that have since
+   // matched are skipped.
+   unsigned long max_elements;
+   key_type* insertion_order;
+   unsigned long insertion_start;
+   unsigned long insertion_end;
+   unsigned long insertion_capacity;
 } token_waiting_table_type;
 
-void run_matching_unit(queue* incoming_token_queue, queue* ready_token_pair_queue, uint32_t max_table_size);
-void add_to_waiting_table(key_type key, token_type token);
-void remove_from_waiting_table(key_type key);
+typedef _Atomic uint64_t matching_unit_counter;
+
+key_type token_to_key(token_type token);
+uint32_t key_to_matching_unit(key_type key, uint32_t num_matching_units);
+matching_unit_counter* new_matching_unit_counters(uint32_t num_units);
+/* tokens_spilled and tokens_restored count the tokens that went to the
+   overflow store and came back from it, the machine reports them */
+void run_matching_unit(queue* incoming_token_queue, queue* ready_token_pair_queue, uint32_t initial_table_size, unsigned long max_waiting_tokens, char* overflow_directory, matching_unit_counter* tokens_done, matching_unit_counter* tokens_spilled, matching_unit_counter* tokens_restored, token_type* restored_tokens, unsigned long num_restored_tokens);
+bool match_in_waiting_table(key_type key, token_type token, token_type* partner);
 
 #endif /* MATCHING_UNIT_H */
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "khash.h"
+#include "overflow_store.h"
+
+static inline khint_t key_hash(key_type key)
+{
+   return kh_int64_hash_func(key.tag ^ ((uint64_t)key.destination << 32));
+}
+
+static inline bool key_equal(key_type key1, key_type key2)
+{
+   return key1.tag == key2.tag && key1.destination == key2.destination;
+}
+
+KHASH_INIT(overflow_index, key_type, off_t, 1, key_hash, key_equal)
+
+struct _overflow_store {
+   int fd;
+   off_t end;
+   khash_t(overflow_index)* index;
+   // Offsets before end that no token is using
+   off_t* free_slots;
+   unsigned long num_free_slots;
+   unsigned long free_slots_capacity;
+};
+
+overflow_store* overflow_store_new(char* directory)
+{
+   overflow_store* to_return = (overflow_store*)calloc(1, sizeof(overflow_store));
+   char* path = (char*)malloc(strlen(directory) + sizeof("/overflow_store.XXXXXX"));
+   sprintf(path, "%s/overflow_store.XXXXXX", directory);
+   to_return->fd = mkstemp(path);
+   if (to_return->fd == -1)
+   {
+	  #ifdef DEBUG
+	  perror("Error creating the overflow store");
+	  #endif
+	  exit(-1);
+   }
+   // Nothing else needs it, and it goes away with the matching unit
+   unlink(path);
+   free(path);
+
+   to_return->end = 0;
+   to_return->index = kh_init(overflow_index);
+   return to_return;
+}
+
+/* Required that key is not already in the store */
+void overflow_store_put(overflow_store* store, key_type key, token_type token)
+{
+   off_t offset = store->end;
+   if (store->num_free_slots != 0)
+   {
+	  offset = store->free_slots[--store->num_free_slots];
+   }
+
+   if (pwrite(store->fd, &token, sizeof(token_type), offset) != sizeof(token_type))
+   {
+	  #ifdef DEBUG
+	  perror("Error writing to the overflow store");
+	  #endif
+	  exit(-1);
+   }
+
+   int ret;
+   khint_t iter = kh_put(overflow_index, store->index, key, &ret);
+   kh_value(store->index, iter) = offset;
+   if (offset == store->end)
+   {
+	  store->end += sizeof(token_type);
+   }
+}
+
+bool overflow_store_take(overflow_store* store, key_type key, token_type* token)
+{
+   khint_t iter = kh_get(overflow_index, store->index, key);
+   if (iter == kh_end(store->index))
+   {
+	  return false;
+   }
+
+   if (pread(store->fd, token, sizeof(token_type), kh_value(store->index, iter)) != sizeof(token_type))
+   {
+	  #ifdef DEBUG
+	  perror("Error reading from the overflow store");
+	  #endif
+	  exit(-1);
+   }
+
+   if (store->num_free_slots == store->free_slots_capacity)
+   {
+	  store->free_slots_capacity = store->free_slots_capacity == 0 ? 1024 : store->free_slots_capacity * 2;
+	  store->free_slots = (off_t*)realloc(store->free_slots, sizeof(off_t) * store->free_slots_capacity);
+   }
+   store->free_slots[store->num_free_slots++] = kh_value(store->index, iter);
+   kh_del(overflow_index, store->index, iter);
+
+   // Give the space back once everything has been taken back
+   if (kh_size(store->index) == 0)
+   {
+	  if (ftruncate(store->fd, 0) == -1)
+	  {
+		 #ifdef DEBUG
+		 perror("Error truncating the overflow store");
+		 #endif
+		 exit(-1);
+	  }
+	  store->end = 0;
+	  store->num_free_slots = 0;
+   }
+   return true;
+}
+
+unsigned long overflow_store_size(overflow_store* store)
+{
+   return kh_size(store->index);
+}
+
+void overflow_store_for_each(overflow_store* store, void (*visit)(token_type token, void* arg), void* arg)
+{
+   for (khint_t iter = kh_begin(store->index); iter != kh_end(store->index); iter++)
+   {
+	  token_type token;
+	  if (kh_exist(store->index, iter) &&
+		  pread(store->fd, &token, sizeof(token_type), kh_value(store->index, iter)) == sizeof(token_type))
+	  {
+		 visit(token, arg);
+	  }
+   }
+}
@@ -0,0 +1,21 @@
+#ifndef OVERFLOW_STORE_H
+#define OVERFLOW_STORE_H
+
+#include <stdbool.h>
+
+#include "matching_unit.h"
+
+// Waiting tokens spilled out of the matching unit's table. Tokens are
+// kept in an unlinked file in directory, only their keys and offsets
+// stay in memory. Slots of taken tokens are reused, so the file only
+// grows as big as the most tokens spilled at once.
+typedef struct _overflow_store overflow_store;
+
+overflow_store* overflow_store_new(char* directory);
+void overflow_store_put(overflow_store* store, key_type key, token_type token);
+bool overflow_store_take(overflow_store* store, key_type key, token_type* token);
+unsigned long overflow_store_size(overflow_store* store);
+/* Calls visit with every token in the store */
+void overflow_store_for_each(overflow_store* store, void (*visit)(token_type token, void* arg), void* arg);
+
+#endif /* OVERFLOW_STORE_H */
@@ -1,14 +1,18 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "checkpoint.h"
 #include "processing_unit.h"
 #include "queue.h"
-#include "khash.h"
 
 #define TRAP_CODE_LIMIT 100
+#define TRAP_TABLE_SIZE (1 << 16)
 
 #ifdef ENABLE_TRAP_MODE
 bool trap_flag = true;
@@ -18,31 +22,177 @@ bool trap_flag = false;
 
 
 
-KHASH_MAP_INIT_INT64(trap_waiting, token_type)
-
+// khash's 64 bit integer hash
 uint64_t hash(uint64_t var)
 {
-   return kh_int64_hash_func(var);
+   return (uint32_t)(var >> 33 ^ var ^ var << 11);
+}
+
+// Tokens waiting for the trap handler to OK them, keyed by the
+// random return destination. The RTD that finishes the single step
+// can be executed by any of the processing units, so this lives in
+// shared memory rather than in a per-unit khash. Linear probing with
+// backward shift deletion.
+typedef struct {
+   bool used;
+   destination_type key;
+   token_type token;
+} trap_entry;
+
+typedef struct {
+   pthread_mutex_t lock;
+   trap_entry entries[TRAP_TABLE_SIZE];
+} trap_table_type;
+
+trap_table_type* trap_table = NULL;
+
+uint32_t processing_unit_index = 0;
+uint32_t num_processing_units = 1;
+uint32_t random_seed = 0;
+
+void init_processing_units(uint32_t num_units, uint32_t seed)
+{
+   num_processing_units = num_units;
+   random_seed = seed;
+   if (trap_flag)
+   {
+	  trap_table = (trap_table_type*) mmap(NULL, sizeof(trap_table_type), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	  if (trap_table == MAP_FAILED)
+	  {
+		 #ifdef DEBUG
+		 perror("mmap fail");
+		 #endif
+		 exit(-1);
+	  }
+	  pthread_mutexattr_t attr;
+	  pthread_mutexattr_init(&attr);
+	  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	  pthread_mutex_init(&trap_table->lock, &attr);
+	  pthread_mutexattr_destroy(&attr);
+   }
+}
+
+static void trap_table_put(destination_type key, token_type token)
+{
+   pthread_mutex_lock(&trap_table->lock);
+   uint32_t idx = hash(key) & (TRAP_TABLE_SIZE - 1);
+   for (uint32_t i = 0; i < TRAP_TABLE_SIZE; i++)
+   {
+	  trap_entry* entry = &trap_table->entries[(idx + i) & (TRAP_TABLE_SIZE - 1)];
+	  if (!entry->used || entry->key == key)
+	  {
+		 entry->used = true;
+		 entry->key = key;
+		 entry->token = token;
+		 pthread_mutex_unlock(&trap_table->lock);
+		 return;
+	  }
+   }
+   pthread_mutex_unlock(&trap_table->lock);
+
+   // Dropping the token would silently lose a step of the program
+   fprintf(stderr, "Error, more than %d tokens are waiting for the trap handler.\n", TRAP_TABLE_SIZE);
+   exit(-1);
+}
+
+static bool trap_table_take(destination_type key, token_type* token)
+{
+   bool found = false;
+   pthread_mutex_lock(&trap_table->lock);
+   uint32_t idx = hash(key) & (TRAP_TABLE_SIZE - 1);
+   for (uint32_t i = 0; i < TRAP_TABLE_SIZE; i++)
+   {
+	  uint32_t hole = (idx + i) & (TRAP_TABLE_SIZE - 1);
+	  trap_entry* entry = &trap_table->entries[hole];
+	  if (!entry->used)
+	  {
+		 break;
+	  }
+	  if (entry->key != key)
+	  {
+		 continue;
+	  }
+
+	  *token = entry->token;
+	  found = true;
+
+	  // shift back the entries after the hole that would otherwise
+	  // become unreachable.
+	  for (uint32_t j = (hole + 1) & (TRAP_TABLE_SIZE - 1); trap_table->entries[j].used; j = (j + 1) & (TRAP_TABLE_SIZE - 1))
+	  {
+		 uint32_t home = hash(trap_table->entries[j].key) & (TRAP_TABLE_SIZE - 1);
+		 if (((j - home) & (TRAP_TABLE_SIZE - 1)) >= ((j - hole) & (TRAP_TABLE_SIZE - 1)))
+		 {
+			trap_table->entries[hole] = trap_table->entries[j];
+			hole = j;
+		 }
+	  }
+	  trap_table->entries[hole].used = false;
+	  break;
+   }
+   pthread_mutex_unlock(&trap_table->lock);
+   return found;
+}
+
+void save_trapped_tokens(int fd)
+{
+   if (trap_table == NULL)
+   {
+	  return;
+   }
+   uint64_t num_trapped = 0;
+   for (uint32_t i = 0; i < TRAP_TABLE_SIZE; i++)
+   {
+	  num_trapped += trap_table->entries[i].used;
+   }
+   checkpoint_write_section(fd, SNAPSHOT_TRAPPED_TOKENS, sizeof(trapped_token), num_trapped);
+   for (uint32_t i = 0; i < TRAP_TABLE_SIZE; i++)
+   {
+	  if (trap_table->entries[i].used)
+	  {
+		 trapped_token trapped = {.key = trap_table->entries[i].key, .token = trap_table->entries[i].token};
+		 checkpoint_write(fd, &trapped, sizeof(trapped_token));
+	  }
+   }
+}
+
+void restore_trapped_tokens(trapped_token* trapped, unsigned long num_trapped)
+{
+   for (unsigned long i = 0; i < num_trapped && trap_table != NULL; i++)
+   {
+	  trap_table_put(trapped[i].key, trapped[i].token);
+   }
+}
+
+// random(), but restricted to the values that are equal to this
+// unit's index modulo the number of units, so that the tag areas (and
+// trap return destinations) that different processing units hand out
+// can never collide. They are also below MODULE_TAG_AREA_BIT, so they
+// can't collide with the module runs' tag areas either. With one unit
+// this is just random().
+static uint32_t partitioned_random()
+{
+   return ((uint32_t)random() % (MODULE_TAG_AREA_BIT / num_processing_units)) * num_processing_units + processing_unit_index;
 }
 
 tag_area_type new_tag_area()
 {
-   return (tag_area_type) random();
+   return (tag_area_type) partitioned_random();
 }
 
 
-void send_result(execution_result result, queue* outgoing_token_packets)
+void send_result(execution_result result, queue_batch* outgoing_token_packets)
 {   
    // Always add the first output
-   queue_add(outgoing_token_packets, &result.output_1, sizeof(token_type));
+   queue_batch_add(outgoing_token_packets, &result.output_1, sizeof(token_type));
 
    if (result.marker == BOTH_OUTPUT_MARKER)
    {
-      queue_add(outgoing_token_packets, &result.output_2, sizeof(token_type));
+      queue_batch_add(outgoing_token_packets, &result.output_2, sizeof(token_type));
    }
 }
 
-void single_step_token(destination_type input, token_type token, queue* outgoing_token_packets, khash_t(trap_waiting) *hash_table)
+void single_step_token(destination_type input, token_type token, queue_batch* outgoing_token_packets)
 {
    tag_area_type new_tag = new_tag_area();
    token_type destination_0 = {
@@ -50,7 +200,7 @@ void single_step_token(destination_type input, token_type token, queue* outgoing
       .data = hash(input),
       .tag = new_tag,
    };
-   queue_add(outgoing_token_packets, &destination_0, sizeof(token_type));
+   queue_batch_add(outgoing_token_packets, &destination_0, sizeof(token_type));
 
    #ifdef DEBUG
    print_token(destination_0);
@@ -61,30 +211,27 @@ void single_step_token(destination_type input, token_type token, queue* outgoing
       .data = hash(token.destination),
       .tag = new_tag,
    };
-   queue_add(outgoing_token_packets, &destination_1, sizeof(token_type));
+   queue_batch_add(outgoing_token_packets, &destination_1, sizeof(token_type));
 
    #ifdef DEBUG
    print_token(destination_1);
    #endif
 
-   destination_type random_dest = (destination_type) random();
+   destination_type random_dest = (destination_type) partitioned_random();
 
    token_type destination_2 = {
       .destination = CREATE_DESTINATION(2, INPUT_ONE, MATCHING_ONE),
       .data = random_dest,
       .tag = new_tag,
    };
-   queue_add(outgoing_token_packets, &destination_2, sizeof(token_type));
+   queue_batch_add(outgoing_token_packets, &destination_2, sizeof(token_type));
 
    #ifdef DEBUG
    print_token(destination_2);
    #endif
 
-   // TODO: store new_tag, random_dest as the keys in a hash table that also has the token.
-
-   int ret;
-   khint_t k = kh_put(trap_waiting, hash_table, random_dest, &ret);
-   kh_value(hash_table, k) = token;
+   // Held in the trap table until the RTD for random_dest comes back
+   trap_table_put(random_dest, token);
 
    /* #ifdef DEBUG */
    /* fprintf(stderr, " result of %p\n", */
@@ -94,80 +241,109 @@ void single_step_token(destination_type input, token_type token, queue* outgoing
 
 }
 
-void run_processing_unit(queue* incoming_execution_packets, queue* outgoing_token_packets)
+static void execute_packet(execution_packet next, queue_batch* outgoing_token_packets)
 {
-   khash_t(trap_waiting) *hash_table = kh_init(trap_waiting);
-   
-   pid_t pid = getpid();
-   while(1)
+   execution_result result;
+
+   result = function_unit(next);
+
+   if (trap_flag && next.opcode == RTD)
    {
-	  execution_packet next;
-	  execution_result result;
-	  queue_remove(incoming_execution_packets, &next, sizeof(execution_packet));
-
-	  result = function_unit(next);
-
-      if (trap_flag && next.opcode == RTD)
-      {
-         khint_t k = kh_get(trap_waiting, hash_table, result.output_1.destination);
-         if (k != kh_end(hash_table))
-         {
-
-            #ifdef DEBUG
-            fprintf(stderr, "Result of trap %p, %d\n",
-                    DESTINATION_TO_ADDRESS(next.input),
-                    result.output_1.destination);
-            print_result(result);
-            #endif
-
-            // This packet is the result of the single step
-            // Check the result, if it's good then we send the original token
-            if (result.output_1.data == 1)
-            {
-               token_type to_send = kh_value(hash_table, k);
-               #ifdef DEBUG
-               print_token(to_send);
-               #endif
-               queue_add(outgoing_token_packets, &to_send, sizeof(token_type));
-            }
-            kh_del(trap_waiting, hash_table, k);
-            continue;
-         }
-      }
-
-      if (trap_flag && ((uint16_t)DESTINATION_TO_ADDRESS(next.input) >= TRAP_CODE_LIMIT))
-      {
-
-         #ifdef DEBUG
-         fprintf(stderr, "Trapping result of %p\n",
-                 next.input);
-         print_result(result);
-         #endif
-
-
-         // TODO: add this to the hash table
-         single_step_token(next.input, result.output_1, outgoing_token_packets, hash_table);
+	  token_type to_send;
+	  if (trap_table_take(result.output_1.destination, &to_send))
+	  {
+
+		 #ifdef DEBUG
+		 fprintf(stderr, "Result of trap %p, %d\n",
+				 DESTINATION_TO_ADDRESS(next.input),
+				 result.output_1.destination);
+		 print_result(result);
+		 #endif
+
+		 // This packet is the result of the single step
+		 // Check the result, if it's good then we send the original token
+		 if (result.output_1.data == 1)
+		 {
+			#ifdef DEBUG
+			print_token(to_send);
+			#endif
+			queue_batch_add(outgoing_token_packets, &to_send, sizeof(token_type));
+		 }
+		 return;
+	  }
+   }
+
+   if (trap_flag && ((uint16_t)DESTINATION_TO_ADDRESS(next.input) >= TRAP_CODE_LIMIT))
+   {
+
+	  #ifdef DEBUG
+	  fprintf(stderr, "Trapping result of %p\n",
+			  next.input);
+	  print_result(result);
+	  #endif
+
+
+	  single_step_token(next.input, result.output_1, outgoing_token_packets);
          
-         if (result.marker == BOTH_OUTPUT_MARKER)
-         {
-            single_step_token(next.input, result.output_2, outgoing_token_packets, hash_table);
-         }
-      }
-      else
-      {
-	     #ifdef DEBUG
-         fprintf(stderr, "%d: Execution result of %d %s %lu %lu 0x%lx\n",
-                 pid,
-                 DESTINATION_TO_ADDRESS(next.input),
-                 opcode_to_name[next.opcode],
-                 next.data_1,
-                 next.data_2,
-                 next.tag);
-         print_result(result);
-         #endif
-
-         send_result(result, outgoing_token_packets);
-      }
+	  if (result.marker == BOTH_OUTPUT_MARKER)
+	  {
+		 single_step_token(next.input, result.output_2, outgoing_token_packets);
+	  }
+   }
+   else
+   {
+	  #ifdef DEBUG
+	  fprintf(stderr, "%d: Execution result of %d %s %lu %lu 0x%lx\n",
+			  getpid(),
+			  DESTINATION_TO_ADDRESS(next.input),
+			  opcode_to_name[next.opcode],
+			  next.data_1,
+			  next.data_2,
+			  next.tag);
+	  print_result(result);
+	  #endif
+
+	  send_result(result, outgoing_token_packets);
+   }
+}
+
+void run_processing_unit(queue* incoming_execution_packets, queue* outgoing_token_packets, uint32_t unit_index)
+{
+   execution_packet packets[QUEUE_BURST_SIZE];
+   queue_batch outgoing_tokens;
+   queue_batch_init(&outgoing_tokens, outgoing_token_packets, 2 * QUEUE_BURST_SIZE, sizeof(token_type));
+
+   // Split the bursts between the units so that one of them doesn't
+   // grab all of the ready packets while the others sit idle.
+   unsigned long burst_size = QUEUE_BURST_SIZE / num_processing_units;
+   if (burst_size == 0)
+   {
+	  burst_size = 1;
+   }
+
+   // Unit 0 keeps random()'s default seed, the others get their own.
+   processing_unit_index = unit_index;
+   if (unit_index != 0 || random_seed != 0)
+   {
+	  srandom(random_seed + unit_index + 1);
+   }
+
+   while(1)
+   {
+	  unsigned long num_packets = queue_remove_many(incoming_execution_packets, packets, burst_size, sizeof(execution_packet));
+	  checkpoint_took_work(num_packets);
+
+	  for (unsigned long i = 0; i < num_packets; i++)
+	  {
+		 // HLT exits right away, get everything before it out first
+		 if (packets[i].opcode == HLT)
+		 {
+			queue_batch_flush(&outgoing_tokens);
+		 }
+		 execute_packet(packets[i], &outgoing_tokens);
+	  }
+	  queue_batch_flush(&outgoing_tokens);
+	  checkpoint_finished_work(num_packets);
    }
 }
 
@@ -410,6 +586,8 @@ execution_result function_unit(execution_packet packet)
       case SDF:
       case ULK:
       case LSK:
+      case RDW:
+      case WRW:
 		 #ifdef DEBUG
 		 assert(false);
 		 #endif
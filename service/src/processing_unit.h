@@ -1,10 +1,16 @@
 #ifndef PROCESSING_UNIT_H
 #define PROCESSING_UNIT_H
 
+#include "checkpoint.h"
 #include "types.h"
 #include "queue.h"
 
-void run_processing_unit(queue* incoming_execution_packets, queue* outgoing_token_packets);
+/* Must be called before the processing units are forked. seed 0 keeps random()'s default sequence. */
+void init_processing_units(uint32_t num_units, uint32_t seed);
+/* The trap table is shared, so these work from any process */
+void save_trapped_tokens(int fd);
+void restore_trapped_tokens(trapped_token* trapped, unsigned long num_trapped);
+void run_processing_unit(queue* incoming_execution_packets, queue* outgoing_token_packets, uint32_t unit_index);
 execution_result function_unit(execution_packet packet);
 
 #endif /* PROCESSING_UNIT_H */
@@ -1,11 +1,17 @@
 #include <assert.h>
-#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
 #include <sys/mman.h>
-#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <semaphore.h>
 
@@ -15,105 +21,124 @@
 
 // Basing this on https://github.com/goldshtn/shmemq-blog/blob/master/shmemq.c
 
+#define CACHE_LINE_SIZE 64
+
+// While spinning, give up the CPU every this many polls (the units
+// are usually more processes than there are cores).
+#define SPINS_PER_YIELD 32
+
+// head and tail are free-running element counters (the slot is the
+// counter masked by the capacity), so the mapping contains no
+// pointers. They live on separate cache lines because, in the SPSC
+// backend, head is only written by the consumer and tail only by the
+// producer. They are also the futex words that a waiting consumer
+// (on tail) or producer (on head) sleeps on, and the *_waiting
+// counters tell the other side whether a wake up is needed.
 typedef struct {
-   pthread_mutex_t lock;
-   char* head;
-   char* tail;
-   char data[1];
+   _Atomic uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+   _Atomic uint32_t writers_waiting;
+   _Atomic uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+   _Atomic uint32_t readers_waiting;
+   pthread_mutex_t lock __attribute__((aligned(CACHE_LINE_SIZE)));
+   sem_t can_write_lock;
+   sem_t can_read_lock;
+   char data[] __attribute__((aligned(CACHE_LINE_SIZE)));
 } shared_queue;
 
 struct _queue {
+   int flags;
+   int wait_strategy;
+   unsigned long spin_limit;
    unsigned long max_count;
+   uint32_t mask;
    unsigned int element_size;
    unsigned long max_size;
-   char* name;
-   int shmem_fd;
    unsigned long mmap_size;
    sem_t* can_write_lock;
    sem_t* can_read_lock;   
+   // MPMC backend only: a sequence number per slot, in the mapping
+   // after the data (see queue_add_many_mpmc)
+   _Atomic uint32_t* sequence;
    shared_queue* mem;
+   // Process local, see queue_set_interrupt
+   volatile sig_atomic_t* interrupt;
 };
 
-queue* queue_new(char* name, unsigned long max_count, unsigned int element_size)
+static inline char* queue_slot(queue* ptr, uint32_t counter)
 {
-   queue* to_return;
+   return ptr->mem->data + ((unsigned long)(counter & ptr->mask) * ptr->element_size);
+}
 
-   to_return = (queue*)malloc(sizeof(queue));
-   to_return->max_count = max_count;
-   to_return->element_size = element_size;
-   to_return->max_size = max_count * element_size;
-   to_return->name = strdup(name);
-   to_return->mmap_size = to_return->max_size + sizeof(shared_queue) - 1;
+queue* queue_new(unsigned long max_count, unsigned int element_size, int flags)
+{
+   queue* to_return;
+   unsigned long capacity = 1;
 
-   // Create the shared memory region
-   if ((to_return->shmem_fd = shm_open(to_return->name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR)) == -1)
+   // Round up to a power of two so that the free-running counters
+   // can be masked into a slot, even when they wrap around.
+   while (capacity < max_count)
    {
-	  #ifdef DEBUG
-	  perror("shm_open fail");
-	  #endif
-	  goto FAIL;
-   }
-   if (shm_unlink(to_return->name) == -1)
-   {
-	  #ifdef DEBUG
-	  perror("shm_unlink fail");
-	  #endif
-	  goto FAIL;
+	  capacity <<= 1;
    }
 
-   if (ftruncate(to_return->shmem_fd, to_return->mmap_size) == -1)
+   to_return = (queue*)malloc(sizeof(queue));
+   to_return->flags = flags;
+   to_return->wait_strategy = QUEUE_WAIT_ADAPTIVE;
+   to_return->spin_limit = QUEUE_DEFAULT_SPIN_LIMIT;
+   to_return->max_count = capacity;
+   to_return->mask = capacity - 1;
+   to_return->element_size = element_size;
+   to_return->interrupt = NULL;
+   to_return->max_size = capacity * element_size;
+   to_return->mmap_size = to_return->max_size + sizeof(shared_queue);
+   if (flags & QUEUE_MPMC)
    {
-	  #ifdef DEBUG
-	  perror("ftruncate fail");
-	  #endif
-	  goto FAIL;
+	  to_return->mmap_size += capacity * sizeof(uint32_t);
    }
 
-   // Create the necessary semaphores
-   if ((to_return->can_write_lock = sem_open(name, O_CREAT, S_IRUSR | S_IWUSR, max_count)) == SEM_FAILED)
+   // Create the shared memory region. It's anonymous, so it is only
+   // shared with the processes that we fork after this, and there's
+   // no name that another machine on the same host can collide with.
+   if ((to_return->mem = (shared_queue*) mmap(NULL, to_return->mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
    {
 	  #ifdef DEBUG
-	  perror("sem_open");
-	  #endif
-	  goto FAIL;
-   }
-   if (sem_unlink(name) == -1)
-   {
-	  #ifdef DEBUG
-	  perror("sem_unlink");
+	  perror("mmap fail");
 	  #endif
 	  goto FAIL;
    }
 
-   // Create the necessary semaphores
-   if ((to_return->can_read_lock = sem_open(name, O_CREAT, S_IRUSR | S_IWUSR, 0)) == SEM_FAILED)
-   {
-	  #ifdef DEBUG
-	  perror("sem_open");
-	  #endif
-	  goto FAIL;
-   }
-   if (sem_unlink(name) == -1)
+   atomic_init(&to_return->mem->head, 0);
+   atomic_init(&to_return->mem->tail, 0);
+   atomic_init(&to_return->mem->writers_waiting, 0);
+   atomic_init(&to_return->mem->readers_waiting, 0);
+
+   if (flags & QUEUE_MPMC)
    {
-	  #ifdef DEBUG
-	  perror("sem_unlink");
-	  #endif
-	  goto FAIL;
+	  // Slot i is free for the producer that claims counter i
+	  to_return->sequence = (_Atomic uint32_t*)(to_return->mem->data + to_return->max_size);
+	  for (uint32_t i = 0; i < capacity; i++)
+	  {
+		 atomic_init(&to_return->sequence[i], i);
+	  }
    }
-   
 
-   if ((to_return->mem = (shared_queue*) mmap(NULL, to_return->mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, to_return->shmem_fd, 0)) == MAP_FAILED)
+   // Only the locked backend blocks on semaphores, the others wait
+   // on the ring counters themselves.
+   if (flags & QUEUE_LOCKED)
    {
-	  #ifdef DEBUG
-	  perror("mmap fail");
-	  #endif
-	  goto FAIL;
-   }
+	  to_return->can_write_lock = &to_return->mem->can_write_lock;
+	  to_return->can_read_lock = &to_return->mem->can_read_lock;
 
-   to_return->mem->head = to_return->mem->data;
-   to_return->mem->tail = to_return->mem->data;
+	  // Create the necessary semaphores
+	  if (sem_init(to_return->can_write_lock, 1, to_return->max_count) == -1 ||
+		  sem_init(to_return->can_read_lock, 1, 0) == -1)
+	  {
+		 #ifdef DEBUG
+		 perror("sem_init");
+		 #endif
+		 goto FAIL;
+	  }
 
-   {
 	  pthread_mutexattr_t attr;
 	  pthread_mutexattr_init(&attr);
 	  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
@@ -125,13 +150,11 @@ queue* queue_new(char* name, unsigned long max_count, unsigned int element_size)
    return to_return;
 
   FAIL:
-   if (to_return->shmem_fd != -1)
+   if (to_return->mem != MAP_FAILED)
    {
-	  close(to_return->shmem_fd);
-	  shm_unlink(to_return->name);
+	  munmap(to_return->mem, to_return->mmap_size);
    }
 
-   free(to_return->name);
    free(to_return);
    return NULL;
 }
@@ -139,74 +162,509 @@ queue* queue_new(char* name, unsigned long max_count, unsigned int element_size)
 void queue_free(queue* ptr)
 {
    munmap(ptr->mem, ptr->mmap_size);
-   close(ptr->shmem_fd);
-   free(ptr->name);
    free(ptr);
 }
 
+void queue_set_wait_strategy(queue* ptr, int wait_strategy, unsigned long spin_limit)
+{
+   ptr->wait_strategy = wait_strategy;
+   ptr->spin_limit = spin_limit;
+}
+
+void queue_set_interrupt(queue* ptr, volatile sig_atomic_t* flag)
+{
+   ptr->interrupt = flag;
+}
+
+static inline bool queue_interrupted(queue* ptr)
+{
+   return ptr->interrupt != NULL && *ptr->interrupt;
+}
+
+// Copy count elements in to (or out of) the ring starting at counter,
+// in at most two pieces because of the wrap around.
+static void queue_copy_in(queue* ptr, uint32_t counter, char* elements, unsigned long count)
+{
+   unsigned long first = ptr->max_count - (counter & ptr->mask);
+   if (first > count)
+   {
+	  first = count;
+   }
+   memcpy(queue_slot(ptr, counter), elements, first * ptr->element_size);
+   memcpy(ptr->mem->data, elements + (first * ptr->element_size), (count - first) * ptr->element_size);
+}
+
+static void queue_copy_out(queue* ptr, uint32_t counter, char* elements, unsigned long count)
+{
+   unsigned long first = ptr->max_count - (counter & ptr->mask);
+   if (first > count)
+   {
+	  first = count;
+   }
+   memcpy(elements, queue_slot(ptr, counter), first * ptr->element_size);
+   memcpy(elements + (first * ptr->element_size), ptr->mem->data, (count - first) * ptr->element_size);
+}
+
+// Block until sem can be taken once, then take it as many more times
+// as possible (up to max) without blocking. 0 if the wait was
+// interrupted and *interrupt is set.
+static unsigned long sem_wait_many(sem_t* sem, unsigned long max, volatile sig_atomic_t* interrupt)
+{
+   unsigned long taken = 1;
+   while (sem_wait(sem) == -1)
+   {
+	  if (interrupt != NULL && *interrupt)
+	  {
+		 return 0;
+	  }
+   }
+   while (taken < max && sem_trywait(sem) == 0)
+   {
+	  taken += 1;
+   }
+   return taken;
+}
+
+static void sem_post_many(sem_t* sem, unsigned long count)
+{
+   for (unsigned long i = 0; i < count; i++)
+   {
+	  sem_post(sem);
+   }
+}
+
+static inline void futex_wait(_Atomic uint32_t* word, uint32_t expected)
+{
+   syscall(SYS_futex, word, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+// False once timeout has passed
+static inline bool futex_wait_timed(_Atomic uint32_t* word, uint32_t expected, struct timespec* timeout)
+{
+   return syscall(SYS_futex, word, FUTEX_WAIT, expected, timeout, NULL, 0) == 0 || errno != ETIMEDOUT;
+}
+
+static inline void futex_wake(_Atomic uint32_t* word)
+{
+   syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline void cpu_relax(unsigned long spins)
+{
+   if ((spins % SPINS_PER_YIELD) == (SPINS_PER_YIELD - 1))
+   {
+	  sched_yield();
+   }
+   else
+   {
+	  #if defined(__x86_64__) || defined(__i386__)
+	  __builtin_ia32_pause();
+	  #endif
+   }
+}
+
+// Wait until *word is no longer expected (i.e., the other side moved
+// its counter), spinning and/or sleeping on the futex depending on the
+// wait strategy. waiting is the counter that the other side checks to
+// know if it has to wake us up.
+static void queue_wait_while(queue* ptr, _Atomic uint32_t* word, uint32_t expected, _Atomic uint32_t* waiting)
+{
+   unsigned long spins = 0;
+   while (atomic_load_explicit(word, memory_order_acquire) == expected)
+   {
+	  // Only consumers give up, see queue_set_interrupt
+	  if (waiting == &ptr->mem->readers_waiting && queue_interrupted(ptr))
+	  {
+		 return;
+	  }
+	  if (ptr->wait_strategy == QUEUE_WAIT_SPIN ||
+		  (ptr->wait_strategy == QUEUE_WAIT_ADAPTIVE && spins < ptr->spin_limit))
+	  {
+		 cpu_relax(spins);
+		 spins += 1;
+		 continue;
+	  }
+
+	  // Announce ourselves before the final check, this pairs with
+	  // the fence in queue_wake_waiters so that a wake up can't be lost.
+	  atomic_fetch_add_explicit(waiting, 1, memory_order_seq_cst);
+	  if (atomic_load_explicit(word, memory_order_seq_cst) == expected)
+	  {
+		 futex_wait(word, expected);
+	  }
+	  atomic_fetch_sub_explicit(waiting, 1, memory_order_relaxed);
+   }
+}
+
+static inline void queue_wake_waiters(_Atomic uint32_t* word, _Atomic uint32_t* waiting)
+{
+   atomic_thread_fence(memory_order_seq_cst);
+   if (atomic_load_explicit(waiting, memory_order_relaxed) != 0)
+   {
+	  futex_wake(word);
+   }
+}
+
 bool queue_add(queue* ptr, void* element, unsigned int len)
 {
-   #ifdef DEBUG
-   assert(len == ptr->element_size);
-   #endif
+   return queue_add_many(ptr, element, 1, len);
+}
 
-   // check if there's enough space
-   // B/C can_write_lock is instantiated with the 
-   sem_wait(ptr->can_write_lock);
-   
+bool queue_remove(queue* ptr, void* element, unsigned int len)
+{
+   return queue_remove_many(ptr, element, 1, len) == 1;
+}
+
+static bool queue_add_many_locked(queue* ptr, char* next, unsigned long count)
+{
+   while (count > 0)
    {
-	  char* next;
+	  // check if there's enough space, and grab as much of it as
+	  // we can in one go.
+	  unsigned long to_add = sem_wait_many(ptr->can_write_lock, count, NULL);
+
 	  pthread_mutex_lock(&ptr->mem->lock);
-	  memcpy((void*)ptr->mem->tail, element, len);
+	  uint32_t tail = atomic_load_explicit(&ptr->mem->tail, memory_order_relaxed);
+	  queue_copy_in(ptr, tail, next, to_add);
+	  atomic_store_explicit(&ptr->mem->tail, tail + to_add, memory_order_relaxed);
+	  pthread_mutex_unlock(&ptr->mem->lock);
+
+	  // Let readers know that there's something to read
+	  sem_post_many(ptr->can_read_lock, to_add);
+
+	  next += to_add * ptr->element_size;
+	  count -= to_add;
+   }
+   return true;
+}
 
-	  // fix up the queue, wrap around as necessary
-	  next = ptr->mem->tail + (ptr->element_size);
+static bool queue_add_many_spsc(queue* ptr, char* next, unsigned long count)
+{
+   // Only this process ever writes tail
+   uint32_t tail = atomic_load_explicit(&ptr->mem->tail, memory_order_relaxed);
+   while (count > 0)
+   {
+	  uint32_t head = atomic_load_explicit(&ptr->mem->head, memory_order_acquire);
+	  if ((uint32_t)(tail - head) == ptr->max_count)
+	  {
+		 // full, wait for the consumer to move head
+		 queue_wait_while(ptr, &ptr->mem->head, head, &ptr->mem->writers_waiting);
+		 continue;
+	  }
 
-	  // Are we at the end of the queue?
-	  if (next == (ptr->mem->data + ptr->max_size))
+	  unsigned long to_add = ptr->max_count - (uint32_t)(tail - head);
+	  if (to_add > count)
 	  {
-		 next = ptr->mem->data;
+		 to_add = count;
 	  }
-	  ptr->mem->tail = next;
-	  pthread_mutex_unlock(&ptr->mem->lock);
+	  queue_copy_in(ptr, tail, next, to_add);
+	  tail += to_add;
+
+	  // the release store publishes the elements to the consumer
+	  atomic_store_explicit(&ptr->mem->tail, tail, memory_order_release);
+	  queue_wake_waiters(&ptr->mem->tail, &ptr->mem->readers_waiting);
+
+	  next += to_add * ptr->element_size;
+	  count -= to_add;
    }
+   return true;
+}
+
+// Multi-producer/multi-consumer ring, based on Dmitry Vyukov's
+// bounded MPMC queue. Producers claim slots by moving tail with a CAS
+// and consumers by moving head with a CAS. Slot i's sequence number
+// says what state it is in for the lap of counter c that maps to it:
+// c means free for the producer of c, c + 1 means written and ready
+// for the consumer of c, and c + capacity means consumed (i.e., free
+// for the producer of the next lap). A batch is the run of consecutive
+// slots in the right state, claimed with a single CAS.
+static bool queue_add_many_mpmc(queue* ptr, char* next, unsigned long count)
+{
+   unsigned long spins = 0;
+   while (count > 0)
+   {
+	  uint32_t tail = atomic_load_explicit(&ptr->mem->tail, memory_order_relaxed);
+	  unsigned long to_add = 0;
+	  while (to_add < count && to_add < ptr->max_count &&
+			 atomic_load_explicit(&ptr->sequence[(tail + to_add) & ptr->mask], memory_order_acquire) == tail + to_add)
+	  {
+		 to_add += 1;
+	  }
 
-   // Let readers know that there's something to read
-   sem_post(ptr->can_read_lock);
+	  if (to_add == 0)
+	  {
+		 uint32_t head = atomic_load_explicit(&ptr->mem->head, memory_order_acquire);
+		 if ((uint32_t)(tail - head) == ptr->max_count)
+		 {
+			// full, wait for a consumer to move head
+			queue_wait_while(ptr, &ptr->mem->head, head, &ptr->mem->writers_waiting);
+		 }
+		 else
+		 {
+			// another producer beat us to tail, or a consumer is
+			// still copying out of the slot.
+			cpu_relax(spins++);
+		 }
+		 continue;
+	  }
+
+	  if (!atomic_compare_exchange_weak_explicit(&ptr->mem->tail, &tail, tail + to_add, memory_order_relaxed, memory_order_relaxed))
+	  {
+		 continue;
+	  }
+
+	  queue_copy_in(ptr, tail, next, to_add);
+	  for (uint32_t i = 0; i < to_add; i++)
+	  {
+		 atomic_store_explicit(&ptr->sequence[(tail + i) & ptr->mask], tail + i + 1, memory_order_release);
+	  }
+	  queue_wake_waiters(&ptr->mem->tail, &ptr->mem->readers_waiting);
+
+	  next += to_add * ptr->element_size;
+	  count -= to_add;
+   }
    return true;
 }
 
-bool queue_remove(queue* ptr, void* element, unsigned int len)
+bool queue_add_many(queue* ptr, void* elements, unsigned long count, unsigned int len)
 {
    #ifdef DEBUG
    assert(len == ptr->element_size);
    #endif
 
-   // wait until there's actually something to read
-   sem_wait(ptr->can_read_lock);
+   if (ptr->flags & QUEUE_LOCKED)
+   {
+	  return queue_add_many_locked(ptr, (char*)elements, count);
+   }
+   if (ptr->flags & QUEUE_MPMC)
+   {
+	  return queue_add_many_mpmc(ptr, (char*)elements, count);
+   }
+   return queue_add_many_spsc(ptr, (char*)elements, count);
+}
 
+static unsigned long queue_remove_many_locked(queue* ptr, char* elements, unsigned long max_count)
+{
+   // wait until there's actually something to read, then take
+   // whatever else is already there.
+   unsigned long to_remove = sem_wait_many(ptr->can_read_lock, max_count, ptr->interrupt);
+   if (to_remove == 0)
    {
-	  char* next;
-	  pthread_mutex_lock(&ptr->mem->lock);
-	  
-	  memcpy(element, (void*)ptr->mem->head, len);
+	  return 0;
+   }
 
-	  next = ptr->mem->head + (ptr->element_size);
+   pthread_mutex_lock(&ptr->mem->lock);
+   uint32_t head = atomic_load_explicit(&ptr->mem->head, memory_order_relaxed);
+   queue_copy_out(ptr, head, elements, to_remove);
+   atomic_store_explicit(&ptr->mem->head, head + to_remove, memory_order_relaxed);
+   pthread_mutex_unlock(&ptr->mem->lock);
 
-	  // are we at the end of the queue?
-	  if (next == (ptr->mem->data + ptr->max_size))
+   // Let writers know that there's space to write
+   sem_post_many(ptr->can_write_lock, to_remove);
+   return to_remove;
+}
+
+static unsigned long queue_remove_many_spsc(queue* ptr, char* elements, unsigned long max_count)
+{
+   // Only this process ever writes head
+   uint32_t head = atomic_load_explicit(&ptr->mem->head, memory_order_relaxed);
+   uint32_t tail = atomic_load_explicit(&ptr->mem->tail, memory_order_acquire);
+   while (tail == head)
+   {
+	  if (queue_interrupted(ptr))
 	  {
-		 next = ptr->mem->data;
+		 return 0;
 	  }
-	  ptr->mem->head = next;
-	  pthread_mutex_unlock(&ptr->mem->lock);	  
+	  // empty, wait for the producer to move tail
+	  queue_wait_while(ptr, &ptr->mem->tail, head, &ptr->mem->readers_waiting);
+	  tail = atomic_load_explicit(&ptr->mem->tail, memory_order_acquire);
    }
 
-   // Let writers know that there's space to write
-   sem_post(ptr->can_write_lock);
+   unsigned long to_remove = (uint32_t)(tail - head);
+   if (to_remove > max_count)
+   {
+	  to_remove = max_count;
+   }
+   queue_copy_out(ptr, head, elements, to_remove);
+
+   // the release store hands the slots back to the producer
+   atomic_store_explicit(&ptr->mem->head, head + to_remove, memory_order_release);
+   queue_wake_waiters(&ptr->mem->head, &ptr->mem->writers_waiting);
+   return to_remove;
+}
+
+static unsigned long queue_remove_many_mpmc(queue* ptr, char* elements, unsigned long max_count)
+{
+   unsigned long spins = 0;
+   while (1)
+   {
+	  uint32_t head = atomic_load_explicit(&ptr->mem->head, memory_order_relaxed);
+	  unsigned long to_remove = 0;
+	  while (to_remove < max_count && to_remove < ptr->max_count &&
+			 atomic_load_explicit(&ptr->sequence[(head + to_remove) & ptr->mask], memory_order_acquire) == head + to_remove + 1)
+	  {
+		 to_remove += 1;
+	  }
+
+	  if (to_remove == 0)
+	  {
+		 uint32_t tail = atomic_load_explicit(&ptr->mem->tail, memory_order_acquire);
+		 if (tail == head)
+		 {
+			if (queue_interrupted(ptr))
+			{
+			   return 0;
+			}
+			// empty, wait for a producer to move tail
+			queue_wait_while(ptr, &ptr->mem->tail, head, &ptr->mem->readers_waiting);
+		 }
+		 else
+		 {
+			// another consumer beat us to head, or a producer is
+			// still copying in to the slot.
+			cpu_relax(spins++);
+		 }
+		 continue;
+	  }
+
+	  if (!atomic_compare_exchange_weak_explicit(&ptr->mem->head, &head, head + to_remove, memory_order_relaxed, memory_order_relaxed))
+	  {
+		 continue;
+	  }
+
+	  queue_copy_out(ptr, head, elements, to_remove);
+	  for (uint32_t i = 0; i < to_remove; i++)
+	  {
+		 atomic_store_explicit(&ptr->sequence[(head + i) & ptr->mask], head + i + ptr->max_count, memory_order_release);
+	  }
+	  queue_wake_waiters(&ptr->mem->head, &ptr->mem->writers_waiting);
+	  return to_remove;
+   }
+}
+
+unsigned long queue_remove_many(queue* ptr, void* elements, unsigned long max_count, unsigned int len)
+{
+   #ifdef DEBUG
+   assert(len == ptr->element_size);
+   #endif
+
+   if (ptr->flags & QUEUE_LOCKED)
+   {
+	  return queue_remove_many_locked(ptr, (char*)elements, max_count);
+   }
+   if (ptr->flags & QUEUE_MPMC)
+   {
+	  return queue_remove_many_mpmc(ptr, (char*)elements, max_count);
+   }
+   return queue_remove_many_spsc(ptr, (char*)elements, max_count);
+}
+
+bool queue_is_empty(queue* ptr)
+{
+   uint32_t head = atomic_load_explicit(&ptr->mem->head, memory_order_acquire);
+   uint32_t tail = atomic_load_explicit(&ptr->mem->tail, memory_order_acquire);
+   return head == tail;
+}
+
+static void add_ns(struct timespec* time, unsigned long ns)
+{
+   time->tv_sec += ns / 1000000000;
+   time->tv_nsec += ns % 1000000000;
+   if (time->tv_nsec >= 1000000000)
+   {
+	  time->tv_sec += 1;
+	  time->tv_nsec -= 1000000000;
+   }
+}
+
+bool queue_wait_timed(queue* ptr, unsigned long timeout_ns)
+{
+   if (ptr->flags & QUEUE_LOCKED)
+   {
+	  // Take a reader's count and give it back, the elements stay
+	  struct timespec deadline;
+	  clock_gettime(CLOCK_REALTIME, &deadline);
+	  add_ns(&deadline, timeout_ns);
+	  while (sem_timedwait(ptr->can_read_lock, &deadline) == -1)
+	  {
+		 if (errno != EINTR)
+		 {
+			return false;
+		 }
+	  }
+	  sem_post(ptr->can_read_lock);
+	  return true;
+   }
+
+   // Only consumers move head, so the queue is empty while tail is
+   // still head
+   uint32_t head = atomic_load_explicit(&ptr->mem->head, memory_order_acquire);
+   struct timespec deadline;
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
+   add_ns(&deadline, timeout_ns);
+   while (atomic_load_explicit(&ptr->mem->tail, memory_order_acquire) == head)
+   {
+	  struct timespec now, remaining;
+	  clock_gettime(CLOCK_MONOTONIC, &now);
+	  remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+	  remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+	  if (remaining.tv_nsec < 0)
+	  {
+		 remaining.tv_sec -= 1;
+		 remaining.tv_nsec += 1000000000;
+	  }
+	  if (remaining.tv_sec < 0)
+	  {
+		 return false;
+	  }
+
+	  bool woken = true;
+	  atomic_fetch_add_explicit(&ptr->mem->readers_waiting, 1, memory_order_seq_cst);
+	  if (atomic_load_explicit(&ptr->mem->tail, memory_order_seq_cst) == head)
+	  {
+		 woken = futex_wait_timed(&ptr->mem->tail, head, &remaining);
+	  }
+	  atomic_fetch_sub_explicit(&ptr->mem->readers_waiting, 1, memory_order_relaxed);
+	  if (!woken)
+	  {
+		 return !queue_is_empty(ptr);
+	  }
+   }
    return true;
 }
 
+void queue_batch_init(queue_batch* batch, queue* ptr, unsigned long max_count, unsigned int element_size)
+{
+   batch->queue = ptr;
+   batch->element_size = element_size;
+   batch->count = 0;
+   batch->max_count = max_count;
+   batch->elements = (char*)malloc(max_count * element_size);
+}
+
+void queue_batch_add(queue_batch* batch, void* element, unsigned int len)
+{
+   #ifdef DEBUG
+   assert(len == batch->element_size);
+   #endif
+
+   if (batch->count == batch->max_count)
+   {
+	  queue_batch_flush(batch);
+   }
+   memcpy(batch->elements + (batch->count * batch->element_size), element, len);
+   batch->count += 1;
+}
+
+void queue_batch_flush(queue_batch* batch)
+{
+   if (batch->count != 0)
+   {
+	  queue_add_many(batch->queue, batch->elements, batch->count, batch->element_size);
+	  batch->count = 0;
+   }
+}
+
 /* int main(int argc, char** argv) */
 /* { */
 /*    int test = 100; */
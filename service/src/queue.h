@@ -1,15 +1,66 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
+#include <signal.h>
 #include <stdbool.h>
 
 typedef struct _queue queue;
 
-/* Shared multi-process compatible queue */
-queue* queue_new(char* name, unsigned long max_count, unsigned int element_size);
+/* Queue flags */
+// Lock-free single-producer/single-consumer ring (the default)
+#define QUEUE_SPSC 0x0
+// Mutex protected ring, safe for any number of producers and consumers
+#define QUEUE_LOCKED 0x1
+// Lock-free ring, safe for any number of producers and consumers
+#define QUEUE_MPMC 0x2
+
+/* Wait strategies (how a full/empty lock-free queue is waited on) */
+// Busy-poll (yielding now and then), never sleep
+#define QUEUE_WAIT_SPIN 0
+// Busy-poll for up to spin_limit polls, then sleep on a futex (the default)
+#define QUEUE_WAIT_ADAPTIVE 1
+// Sleep on a futex right away
+#define QUEUE_WAIT_BLOCK 2
+
+#define QUEUE_DEFAULT_SPIN_LIMIT 32
+
+/* Shared multi-process compatible queue, shared with the processes forked after it is created */
+queue* queue_new(unsigned long max_count, unsigned int element_size, int flags);
 void queue_free(queue* ptr);
+/* Must be set before the queue is shared. The locked backend always blocks on its semaphores. */
+void queue_set_wait_strategy(queue* ptr, int wait_strategy, unsigned long spin_limit);
+/* This process stops waiting to remove from the queue (queue_remove_many returns 0) once *flag is
+   set. It is meant to be set by a signal handler installed without SA_RESTART. */
+void queue_set_interrupt(queue* ptr, volatile sig_atomic_t* flag);
 
 bool queue_add(queue* ptr, void* element, unsigned int len);
 bool queue_remove(queue* ptr, void* element, unsigned int len);
 
+/* Add all count elements (blocking while the queue is full) */
+bool queue_add_many(queue* ptr, void* elements, unsigned long count, unsigned int len);
+/* Remove up to max_count elements, only blocks until the first is available. Returns the number removed. */
+unsigned long queue_remove_many(queue* ptr, void* elements, unsigned long max_count, unsigned int len);
+
+/* Only a hint, other processes can add or remove right after */
+bool queue_is_empty(queue* ptr);
+/* Wait (as a consumer) up to timeout_ns for the queue to not be empty. True if it isn't. */
+bool queue_wait_timed(queue* ptr, unsigned long timeout_ns);
+
+/* Number of elements the units try to move per queue operation */
+#define QUEUE_BURST_SIZE 64
+
+/* Process-local staging area that is pushed to a queue with queue_add_many */
+typedef struct {
+   queue* queue;
+   unsigned int element_size;
+   unsigned long count;
+   unsigned long max_count;
+   char* elements;
+} queue_batch;
+
+void queue_batch_init(queue_batch* batch, queue* ptr, unsigned long max_count, unsigned int element_size);
+/* Stage an element, flushing first if the batch is full */
+void queue_batch_add(queue_batch* batch, void* element, unsigned int len);
+void queue_batch_flush(queue_batch* batch);
+
 #endif /* QUEUE_H */
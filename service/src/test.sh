@@ -12,6 +12,7 @@ FAILURES=0
 
 mkdir -p build/programs/assembly
 mkdir -p build/programs/force
+mkdir -p build/programs/snapshot
 
 echo "Testing assembler"
 for f in programs/assembly/*.output
@@ -63,6 +64,31 @@ do
 
 done
 
+# Snapshot each program where it first waits for stdin, then restore it
+# with the input, it has to look the same as a run from the start
+echo "Testing snapshots"
+for f in programs/snapshot/*.output
+do
+	CASES=$((CASES+1))
+	NAME=$(basename -s .output $f)
+	ASSEMBLY="programs/snapshot/$NAME.tass"
+	INPUT="programs/snapshot/$NAME.input"
+    OUTPUT_DIR="build/programs/snapshot"
+    OUTPUT="$OUTPUT_DIR/$NAME.bin"
+    SNAPSHOT="$OUTPUT_DIR/$NAME.snap"
+	echo "Assembling $NAME"
+	python3 assembler.py --file "$ASSEMBLY" --output "$OUTPUT"
+	echo "Testing $NAME (test case $CASES)"
+    cp "$f" "$INPUT" "$OUTPUT_DIR"
+	./build/manchester -f "$OUTPUT" -c "$SNAPSHOT" > /dev/null 2>&1 < /dev/null
+	diff -w "$f" <(./build/manchester -r "$SNAPSHOT" -t 1 2> /dev/null < "$INPUT")
+	if [ $? -ne 0 ]
+	then
+		echo -e "${RED}FAILED TEST CASE $NAME${NC}"
+		FAILURES=$((FAILURES+1))
+	fi
+done
+
 if [ "$FAILURES" -eq 0 ]
 then
 	echo -e "${GREEN}All $CASES test cases PASSED!${NC}"
@@ -37,6 +37,8 @@ uint8_t opcode_to_num_inputs[] = {
    /* ULK */ 1,
    /* LSK */ 2,
    /* RND */ 1,
+   /* RDW */ 2,
+   /* WRW */ 2,
 };
 
 /* Not actually used, please change code in instruction_store.c */
@@ -52,6 +54,8 @@ opcode_type privileged_opcodes[] = {
    ULK,
    LSK,
    RND,
+   RDW,
+   WRW,
 };
 
 #ifdef DEBUG
@@ -91,5 +95,7 @@ char* opcode_to_name[] = {
    "ULK",
    "LSK",
    "RND",
+   "RDW",
+   "WRW",
 };
 #endif
@@ -39,6 +39,8 @@ typedef enum {ADD,
               ULK, /* unlink */
               LSK, /* lseek */
               RND, /* Random */
+              RDW, /* read word */
+              WRW, /* write word */
 } opcode_type;
 
 // defined in "types.c". Must be kept in sync with opcode_type ^
@@ -58,6 +60,10 @@ typedef uint32_t iteration_count_type;
 #define TAG_TO_ITERATION_COUNT(t) ((uint32_t)(0xffffffff & t))
 
 #define NO_TAG 0
+// Tag areas with this bit set are only handed out by the instruction
+// store, one per module run (see run_module). The processing units'
+// new tag areas always stay below it.
+#define MODULE_TAG_AREA_BIT 0x80000000
 
 typedef uint64_t data_type;
 
@@ -111,6 +117,24 @@ typedef struct {
 #define REGISTER_INPUT_HANDLER_DESTINATION CREATE_DESTINATION(((1<<28)-3), 0, MATCHING_ONE)
 #define DEREGISTER_INPUT_HANDLER_DESTINATION CREATE_DESTINATION(((1<<28)-4), 0, MATCHING_ONE)
 #define DEV_NULL_DESTINATION CREATE_DESTINATION(((1<<28)-5), 0, MATCHING_ONE)
+// The instruction store's loader thread wakes it up with this
+#define PROGRAM_LOADED_DESTINATION CREATE_DESTINATION(((1<<28)-6), 0, MATCHING_ONE)
+// A loaded program's main returns here, see run_module
+#define MODULE_RETURN_DESTINATION CREATE_DESTINATION(((1<<28)-7), 0, MATCHING_ONE)
+
+/*
+  Input handlers. The data of a token sent to
+  REGISTER_INPUT_HANDLER_DESTINATION is the fd in bits 32-62 and the
+  destination to send its input to in the low 32 bits. Input arrives
+  one byte per token with the registering token's tag, or with
+  INPUT_HANDLER_WORDS up to 8 bytes per token packed like a string.
+  A token with data -1 marks EOF, after which the handler is gone.
+  The data of a token sent to DEREGISTER_INPUT_HANDLER_DESTINATION is
+  the fd.
+*/
+#define INPUT_HANDLER_WORDS (1UL << 63)
+#define INPUT_HANDLER_TO_FD(d) ((int)((d >> 32) & 0x7fffffff))
+#define INPUT_HANDLER_TO_DESTINATION(d) ((destination_type)(d & 0xffffffff))
 
 typedef struct {
    data_type data_1;